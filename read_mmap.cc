@@ -5,23 +5,57 @@
  *
  * This is only tested for linux, however it may compile/run on mac/windows.
  */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #if defined(_WIN32)
 #include <windows.h>
 #else
 #include <fcntl.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#endif
+
 #if defined(_WIN32)
 void install_signal_handlers() {}
 #else
@@ -87,26 +121,852 @@ bool safe_mmap_try(F fn) {
 #endif
 }
 
+// Flags controlling how file::read_batch schedules its reads
+enum batch_flags : unsigned {
+    batch_default = 0,
+
+    // Read in address order, scattering results back to the caller's order
+    batch_sorted = 1 << 0,
+
+    // Use vector gathers when the CPU supports them. Ignored with
+    // batch_sorted, as the gather needs the offsets in result order.
+    batch_gather = 1 << 1,
+
+    // Prefetch items ahead of the one being loaded so cache misses overlap,
+    // see calibrate_prefetch_distance
+    batch_prefetch = 1 << 2,
+};
+
+// How many items ahead batched reads should prefetch. A fixed guess until
+// calibrate_prefetch_distance is called.
+static std::atomic<size_t> prefetch_distance_items{16};
+
+static size_t prefetch_distance() {
+    return prefetch_distance_items.load(std::memory_order_relaxed);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Gather kernels load as many complete vectors of offsets as they can,
+// updating done after each so a fault can be pinned to a single vector.
+// The remaining items are left to the scalar path.
+typedef void (*gather_fn)(
+    const void* base, const size_t* offsets, size_t count, int64_t* results,
+    volatile size_t* done);
+
+__attribute__((target("avx2")))
+static void gather_avx2(
+        const void* base, const size_t* offsets, size_t count,
+        int64_t* results, volatile size_t* done) {
+    for (size_t i = *done; i + 4 <= count; i += 4) {
+        __m256i index = _mm256_loadu_si256((const __m256i*)(offsets + i));
+        __m256i value = _mm256_i64gather_epi64(
+            (const long long*)base, index, 1);
+        _mm256_storeu_si256((__m256i*)(results + i), value);
+        *done = i + 4;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void gather_avx512(
+        const void* base, const size_t* offsets, size_t count,
+        int64_t* results, volatile size_t* done) {
+    for (size_t i = *done; i + 8 <= count; i += 8) {
+        __m512i index = _mm512_loadu_si512(offsets + i);
+        __m512i value = _mm512_mask_i64gather_epi64(
+            _mm512_setzero_si512(), 0xff, index, base, 1);
+        _mm512_storeu_si512(results + i, value);
+        *done = i + 8;
+    }
+}
+
+// Pick the widest gather the CPU supports, or nullptr if there are none
+static gather_fn select_gather() {
+    static const gather_fn fn = []() -> gather_fn {
+        if (__builtin_cpu_supports("avx512f"))
+            return &gather_avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return &gather_avx2;
+        return nullptr;
+    }();
+    return fn;
+}
+#endif
+
+// An offset in a batch and its position in the caller's order
+struct batch_entry {
+    size_t offset;
+    uint32_t index;
+};
+
+// Sort a batch of offsets into ascending address order by 4KB page, keeping
+// each one's position. The order within a page doesn't matter to the page
+// cache or the TLB, so the low 12 bits are left unsorted. Uses an LSD radix
+// sort, skipping the high bytes that no offset below max_offset can use.
+// scratch is reused as the sort's second buffer.
+static void sort_offsets(
+        const size_t* offsets, size_t count, size_t max_offset,
+        std::vector<batch_entry>& sorted, std::vector<batch_entry>& scratch) {
+    assert(count <= UINT32_MAX);
+
+    sorted.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        sorted[i] = {offsets[i], (uint32_t)i};
+
+    // Small batches aren't worth the histogram passes
+    if (count < 256) {
+        std::sort(sorted.begin(), sorted.end(),
+            [](const batch_entry& a, const batch_entry& b) {
+                return a.offset < b.offset;
+            });
+        return;
+    }
+
+    scratch.resize(count);
+    for (int shift = 12; shift < 64 && (max_offset >> shift) != 0; shift += 8) {
+        size_t histogram[257] = {};
+
+        for (size_t i = 0; i < count; ++i)
+            ++histogram[((sorted[i].offset >> shift) & 0xff) + 1];
+
+        for (int i = 0; i < 256; ++i)
+            histogram[i + 1] += histogram[i];
+
+        for (size_t i = 0; i < count; ++i)
+            scratch[histogram[(sorted[i].offset >> shift) & 0xff]++] =
+                sorted[i];
+
+        sorted.swap(scratch);
+    }
+}
+
+// Search length bytes of haystack for needle, returning the first match
+typedef const uint8_t* (*search_fn)(
+    const uint8_t* haystack, size_t length, const uint8_t* needle,
+    size_t needle_length);
+
+static const uint8_t* search_scalar(
+        const uint8_t* haystack, size_t length, const uint8_t* needle,
+        size_t needle_length) {
+    if (needle_length == 0)
+        return haystack;
+    if (needle_length > length)
+        return nullptr;
+
+    const uint8_t* end = haystack + length - needle_length + 1;
+    for (const uint8_t* at = haystack; at < end; ++at) {
+        at = (const uint8_t*)memchr(at, needle[0], end - at);
+        if (!at)
+            return nullptr;
+
+        if (memcmp(at + 1, needle + 1, needle_length - 1) == 0)
+            return at;
+    }
+    return nullptr;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Compare the first and last bytes of the needle against 32 positions at
+// once, only verifying the positions where both match. A single byte needle
+// needs no verification.
+__attribute__((target("avx2")))
+static const uint8_t* search_avx2(
+        const uint8_t* haystack, size_t length, const uint8_t* needle,
+        size_t needle_length) {
+    if (needle_length == 0)
+        return haystack;
+    if (needle_length > length)
+        return nullptr;
+
+    size_t last = needle_length - 1;
+    size_t positions = length - last;
+
+    __m256i first_byte = _mm256_set1_epi8((char)needle[0]);
+    __m256i last_byte = _mm256_set1_epi8((char)needle[last]);
+
+    size_t i = 0;
+    for (; i + 32 <= positions; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(haystack + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(haystack + i + last));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(a, first_byte), _mm256_cmpeq_epi8(b, last_byte)));
+
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (needle_length <= 2 || memcmp(
+                    haystack + at + 1, needle + 1, needle_length - 2) == 0)
+                return haystack + at;
+            mask &= mask - 1;
+        }
+    }
+
+    return search_scalar(
+        haystack + i, length - i, needle, needle_length);
+}
+#endif
+
+// Pick the widest search kernel the CPU supports
+static search_fn select_search() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const search_fn fn = []() -> search_fn {
+        if (__builtin_cpu_supports("avx2"))
+            return &search_avx2;
+        return &search_scalar;
+    }();
+    return fn;
+#else
+    return &search_scalar;
+#endif
+}
+
+struct find_result {
+    // Byte offset of the first match in the file, or SIZE_MAX if none
+    size_t offset;
+
+    // How many bytes from the start of the range were scanned before a
+    // fault cut the search short, or the whole range if it didn't fault
+    size_t scanned;
+    bool faulted;
+};
+
+// Epoch based reclamation, for data that readers use without taking a lock
+// and that writers replace, such as pinned hot regions. Readers enter an
+// epoch_guard, writers swap the pointer readers load and retire the old
+// data, which is freed once no reader that could have loaded it remains.
+struct epoch_domain {
+    // Epoch each thread entered its guard at, 0 when it isn't reading
+    struct alignas(64) slot {
+        std::atomic<uint64_t> epoch{0};
+        unsigned depth = 0;
+    };
+
+    std::atomic<uint64_t> epoch{1};
+
+    std::mutex mutex;
+    std::vector<slot*> slots;
+    std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+
+    // The calling thread's slot, registered on first use and removed when
+    // the thread exits
+    slot* thread_slot() {
+        struct registration {
+            slot* s;
+
+            registration() : s(new slot()) {
+                epoch_domain& d = get();
+                std::lock_guard<std::mutex> lock(d.mutex);
+                d.slots.push_back(s);
+            }
+
+            ~registration() {
+                epoch_domain& d = get();
+                {
+                    std::lock_guard<std::mutex> lock(d.mutex);
+                    d.slots.erase(std::find(d.slots.begin(), d.slots.end(), s));
+                }
+                delete s;
+                d.reclaim();
+            }
+        };
+        thread_local registration r;
+        return r.s;
+    }
+
+    // Free fn's data once every reader that may be using it has left.
+    // The pointer to the data must already have been replaced.
+    void retire(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.push_back({epoch.fetch_add(1), std::move(fn)});
+        }
+        reclaim();
+    }
+
+    // Free whatever retired data no reader can still be using
+    void reclaim() {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            // Readers that entered at or before an epoch may hold data
+            // retired in it
+            uint64_t oldest = UINT64_MAX;
+            for (slot* s : slots) {
+                uint64_t e = s->epoch.load();
+                if (e)
+                    oldest = std::min(oldest, e);
+            }
+
+            auto it = std::partition(
+                retired.begin(), retired.end(),
+                [&](const auto& r) { return r.first >= oldest; });
+            for (auto i = it; i != retired.end(); ++i)
+                ready.push_back(std::move(i->second));
+            retired.erase(it, retired.end());
+        }
+
+        for (auto& fn : ready)
+            fn();
+    }
+
+    // Leaked so threads exiting during static destruction can still
+    // unregister
+    static epoch_domain& get() {
+        static epoch_domain* domain = new epoch_domain();
+        return *domain;
+    }
+};
+
+// Marks the calling thread as reading data protected by epoch_domain for
+// the guard's lifetime. Guards may nest.
+struct epoch_guard {
+    epoch_domain::slot* s;
+
+    epoch_guard() : s(epoch_domain::get().thread_slot()) {
+        if (s->depth++ == 0)
+            s->epoch.store(epoch_domain::get().epoch.load());
+    }
+
+    ~epoch_guard() {
+        if (--s->depth == 0)
+            s->epoch.store(0, std::memory_order_release);
+    }
+};
+
+struct file;
+
+// Every live file, so the process can account for how much of its memory is
+// mappings. Files add themselves on construction and remove themselves on
+// destruction.
+struct file_registry {
+    std::mutex mutex;
+    std::vector<file*> files;
+
+    // Totals over the files, readable without taking the lock
+    std::atomic<size_t> mapped_bytes{0};
+    std::atomic<size_t> count{0};
+
+    // Bytes of anonymous memory held by pinned hot regions and NUMA
+    // replicas. These aren't mappings of the files so aren't in
+    // mapped_bytes, but use memory all the same. Counted until the copies
+    // are freed, which for replaced copies is once no reader is using them.
+    std::atomic<size_t> copied_bytes{0};
+
+    void add(file* f);
+    void remove(file* f);
+
+    static file_registry& get() {
+        static file_registry registry;
+        return registry;
+    }
+};
+
+// Copies of a file's hottest ranges, such as idx fanout tables, held in
+// anonymous memory so reading them can never fault and needs no guard.
+// Each copy has pages of its own, so locking or unlocking one never touches
+// the heap or another set's copies.
+// Sets are immutable, pinning or unpinning installs a new one and retires
+// the old one through epoch_domain.
+struct hot_region_set {
+    struct region {
+        size_t offset;
+        size_t length;
+        uint8_t* copy;
+
+        // Length of the copy's pages
+        size_t mapped;
+    };
+
+    std::vector<region> regions;
+
+    // Whether the copies are mlocked, cleared when they're unlocked on
+    // unpinning
+    mutable bool locked = false;
+
+    // Version of the file the regions were copied from, see file_version
+    uint64_t version = 0;
+
+    ~hot_region_set() {
+        unlock();
+        for (const region& r : regions) {
+            free_copy(r.copy, r.mapped);
+            file_registry::get().copied_bytes -= r.mapped;
+        }
+    }
+
+    // Page aligned memory for a copy of length bytes, null on failure.
+    // Sets mapped to the length allocated.
+    static uint8_t* allocate_copy(size_t length, size_t* mapped) {
+#if defined(_WIN32)
+        // VirtualAlloc rounds up to whole pages itself
+        *mapped = std::max(length, (size_t)1);
+        return (uint8_t*)VirtualAlloc(
+            NULL, *mapped, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        *mapped = std::max((length + page - 1) / page * page, page);
+        void* copy = mmap(
+            NULL, *mapped, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return copy == MAP_FAILED ? nullptr : (uint8_t*)copy;
+#endif
+    }
+
+    static void free_copy(uint8_t* copy, size_t mapped) {
+#if defined(_WIN32)
+        (void)mapped;
+        VirtualFree(copy, 0, MEM_RELEASE);
+#else
+        munmap(copy, mapped);
+#endif
+    }
+
+    void unlock() const {
+#if !defined(_WIN32)
+        if (locked) {
+            for (const region& r : regions)
+                munlock(r.copy, r.mapped);
+        }
+#endif
+        locked = false;
+    }
+
+    // Copy [offset, offset + length) if a region holds all of it
+    bool read(size_t offset, size_t length, void* out) const {
+        for (const region& r : regions) {
+            if (offset >= r.offset && length <= r.length &&
+                    offset - r.offset <= r.length - length) {
+                memcpy(out, r.copy + (offset - r.offset), length);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// The NUMA node the calling thread is running on, or -1 if it can't be
+// told. Cached per thread and refreshed every so often, as the scheduler
+// may migrate the thread to another node.
+inline int current_numa_node() {
+#if defined(__linux__)
+    thread_local int node = -1;
+    thread_local unsigned calls = 0;
+    if ((calls++ & 1023) == 0) {
+        unsigned cpu, n;
+        node = syscall(SYS_getcpu, &cpu, &n, nullptr) ? -1 : (int)n;
+    }
+    return node;
+#else
+    return -1;
+#endif
+}
+
+// Read-only copies of a whole file in anonymous memory on each NUMA node,
+// so readers on every socket hit local memory. Replaced sets are retired
+// through epoch_domain, like hot_region_set.
+struct numa_replica_set {
+    // Copy for each node, null for nodes without one
+    std::vector<uint8_t*> copies;
+    size_t length = 0;
+
+    ~numa_replica_set() {
+#if defined(__linux__)
+        for (uint8_t* copy : copies) {
+            if (copy) {
+                munmap(copy, length);
+                file_registry::get().copied_bytes -= length;
+            }
+        }
+#endif
+    }
+
+    // The copy on the calling thread's node, if there is one
+    const uint8_t* local() const {
+        int node = current_numa_node();
+        if (node < 0 || (size_t)node >= copies.size())
+            return nullptr;
+        return copies[node];
+    }
+};
+
 struct file {
     const size_t size;
     const void* data;
 
+    // Length of the mapping, which may be rounded up past the file size
+    const size_t mapped_size;
+
+    // Position in file_registry::files
+    size_t registry_index = 0;
+
     // File constructor
-    file(size_t s, void* d) : size(s), data(d) {
+    file(size_t s, void* d) : file(s, d, s) {
+    }
+
+    file(size_t s, void* d, size_t m) : size(s), data(d), mapped_size(m) {
+        file_registry::get().add(this);
     }
 
+    // Pinned copies of hot ranges, see pin_hot_regions
+    std::atomic<const hot_region_set*> hot{nullptr};
+
+    // Per node copies of the file, see replicate_to_nodes
+    std::atomic<const numa_replica_set*> replicas{nullptr};
+
     // Virtual file destructor so we can override per system
-    virtual ~file() {}
+    virtual ~file() {
+        delete hot.load(std::memory_order_relaxed);
+        delete replicas.load(std::memory_order_relaxed);
+        file_registry::get().remove(this);
+    }
+
+    // Copy from a pinned or replicated copy of the range if there is one,
+    // these live in anonymous memory so need no guard
+    bool read_copy(size_t offset, size_t length, void* out) {
+        // Skip the epoch guard when there's nothing to read from
+        if (!hot.load(std::memory_order_relaxed) &&
+                !replicas.load(std::memory_order_relaxed))
+            return false;
+
+        epoch_guard guard;
+
+        const hot_region_set* h = hot.load();
+        if (h && h->read(offset, length, out))
+            return true;
+
+        const numa_replica_set* r = replicas.load();
+        const uint8_t* local = r ? r->local() : nullptr;
+        if (local) {
+            memcpy(out, local + offset, length);
+            return true;
+        }
+        return false;
+    }
 
     // Get a 64 bit integer at the byte offset
     bool read(size_t offset, int64_t * result) {
         // Out of bounds check
         assert(offset <= size - sizeof(int64_t));
 
+        if (read_copy(offset, sizeof(*result), result))
+            return true;
+
         return safe_mmap_try([&]() {
             *result = *(int64_t*)((int8_t*)data + offset);
         });
     }
+
+    // Copy length bytes at the byte offset into out
+    bool read_bytes(size_t offset, size_t length, void* out) {
+        // Out of bounds check
+        assert(offset <= size && length <= size - offset);
+
+        if (read_copy(offset, length, out))
+            return true;
+
+        return safe_mmap_try([&]() {
+            memcpy(out, (int8_t*)data + offset, length);
+        });
+    }
+
+    // Whether every page of a range is in memory, so reading it won't block
+    bool is_resident(size_t offset, size_t length) {
+#if defined(_WIN32)
+        return false;
+#else
+        if (length == 0)
+            return true;
+
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t)data + offset) & ~(page - 1);
+        uintptr_t end = (uintptr_t)data + offset + length;
+        size_t pages = (end - start + page - 1) / page;
+
+        // Only a handful of pages are expected, avoid allocating for them
+        unsigned char small[64];
+        std::vector<unsigned char> large;
+        unsigned char* vec = small;
+        if (pages > sizeof(small)) {
+            large.resize(pages);
+            vec = large.data();
+        }
+
+        if (mincore((void*)start, end - start, vec))
+            return false;
+
+        for (size_t i = 0; i < pages; ++i) {
+            if (!(vec[i] & 1))
+                return false;
+        }
+        return true;
+#endif
+    }
+
+    // Bytes of the mapping currently in memory, scanning every page. This
+    // counts pages in the page cache even if this process never touched
+    // them, unlike the Rss found by scan_residency.
+    size_t resident_bytes() const {
+#if defined(_WIN32)
+        return 0;
+#else
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t pages = (mapped_size + page - 1) / page;
+        size_t resident = 0;
+
+        // Scan in batches to bound the size of the vector
+        unsigned char vec[4096];
+        for (size_t first = 0; first < pages; first += sizeof(vec)) {
+            size_t n = std::min(pages - first, sizeof(vec));
+            uint8_t* start = (uint8_t*)data + first * page;
+            if (mincore(start, n * page, vec))
+                return resident;
+
+            for (size_t i = 0; i < n; ++i)
+                resident += (vec[i] & 1) ? page : 0;
+        }
+
+        return std::min(resident, mapped_size);
+#endif
+    }
+
+    // Read length bytes at the byte offset without blocking the caller, see
+    // async_read_op
+    struct async_read_op async_read(size_t offset, size_t length);
+
+    // Find the first occurrence of needle that starts within
+    // [offset, offset + length) and ends within the file
+    find_result find(
+            const void* needle, size_t needle_length, size_t offset,
+            size_t length) {
+        // Out of bounds check
+        assert(offset <= size && length <= size - offset);
+
+        // Matches may run past the end of the range but not the file
+        size_t end = std::min(size, offset + length + needle_length - 1);
+        search_fn search = select_search();
+
+        // Scan in blocks so a fault can be narrowed down to one block,
+        // overlapping them so matches crossing a boundary are still found
+        const size_t block = 64 << 10;
+        volatile size_t done = 0;
+        const uint8_t* match = nullptr;
+
+        bool success = safe_mmap_try([&]() {
+            for (size_t at = offset; at < offset + length; at += block) {
+                size_t limit = std::min(at + block + needle_length - 1, end);
+                match = search(
+                    (const uint8_t*)data + at, limit - at,
+                    (const uint8_t*)needle, needle_length);
+                if (match)
+                    break;
+
+                done = std::min(at + block, offset + length) - offset;
+            }
+        });
+
+        if (!success)
+            return {SIZE_MAX, done, true};
+
+        if (match)
+            return {(size_t)(match - (const uint8_t*)data), length, false};
+        return {SIZE_MAX, length, false};
+    }
+
+    // Get a batch of 64 bit integers. ok[i] is set to whether offsets[i] was
+    // read into results[i], returns the number of successful reads.
+    size_t read_batch(
+            const size_t* offsets, size_t count, int64_t* results, bool* ok,
+            unsigned flags = batch_default) {
+        if (flags & batch_sorted)
+            return read_batch_sorted(offsets, count, results, ok, flags);
+
+        volatile size_t done = 0;
+        size_t failed = 0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+        gather_fn gather = select_gather();
+        if ((flags & batch_gather) && gather) {
+#ifndef NDEBUG
+            // Out of bounds check
+            for (size_t i = 0; i < count; ++i)
+                assert(offsets[i] <= size - sizeof(int64_t));
+#endif
+
+            // A fault inside a vector means we don't know which lane hit
+            // it, so the scalar path below retries from that vector onward
+            safe_mmap_try([&]() {
+                gather(data, offsets, count, results, &done);
+            });
+
+            std::fill(ok, ok + done, true);
+        }
+#endif
+
+        // Prefetching never faults, so it is safe to run ahead of the guard
+        size_t distance = (flags & batch_prefetch) ? prefetch_distance() : 0;
+
+        // Read as many items as possible inside a single guarded region. If
+        // an item faults mark it as failed and carry on from the next one.
+        while (done < count) {
+            bool success = safe_mmap_try([&]() {
+                for (size_t i = done; i < count; ++i) {
+                    // Out of bounds check
+                    assert(offsets[i] <= size - sizeof(int64_t));
+
+#if defined(__GNUC__)
+                    if (distance && i + distance < count)
+                        __builtin_prefetch(
+                            (int8_t*)data + offsets[i + distance]);
+#endif
+
+                    results[i] = *(int64_t*)((int8_t*)data + offsets[i]);
+                    ok[i] = true;
+                    done = i + 1;
+                }
+            });
+
+            if (!success) {
+                ok[done] = false;
+                ++failed;
+                done = done + 1;
+            }
+        }
+
+        return count - failed;
+    }
+
+private:
+    // read_batch with batch_sorted. Loads go through the sorted offsets in
+    // address order into a buffer of their own, so the mapping is walked
+    // forwards and the kernel's readahead can help, and are only scattered
+    // back to the caller's order once the guarded loop is done. The buffers
+    // are kept per thread so batches don't allocate.
+    size_t read_batch_sorted(
+            const size_t* offsets, size_t count, int64_t* results, bool* ok,
+            unsigned flags) {
+        thread_local std::vector<batch_entry> sorted, scratch;
+        thread_local std::vector<int64_t> values;
+        sort_offsets(offsets, count, size, sorted, scratch);
+        values.resize(count);
+
+        // Positions in sorted order of the items that faulted
+        std::vector<size_t> faulted;
+
+        volatile size_t done = 0;
+        size_t distance = (flags & batch_prefetch) ? prefetch_distance() : 0;
+
+        while (done < count) {
+            bool success = safe_mmap_try([&]() {
+                for (size_t i = done; i < count; ++i) {
+                    // Out of bounds check
+                    assert(sorted[i].offset <= size - sizeof(int64_t));
+
+#if defined(__GNUC__)
+                    if (distance && i + distance < count)
+                        __builtin_prefetch(
+                            (int8_t*)data + sorted[i + distance].offset);
+#endif
+
+                    values[i] = *(int64_t*)((int8_t*)data + sorted[i].offset);
+                    done = i + 1;
+                }
+            });
+
+            if (!success) {
+                values[done] = 0;
+                faulted.push_back((size_t)done);
+                done = done + 1;
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            results[sorted[i].index] = values[i];
+            ok[sorted[i].index] = true;
+        }
+        for (size_t i : faulted)
+            ok[sorted[i].index] = false;
+
+        return count - faulted.size();
+    }
+};
+
+void file_registry::add(file* f) {
+    std::lock_guard<std::mutex> lock(mutex);
+    f->registry_index = files.size();
+    files.push_back(f);
+    mapped_bytes += f->mapped_size;
+    count++;
+}
+
+void file_registry::remove(file* f) {
+    std::lock_guard<std::mutex> lock(mutex);
+    files[f->registry_index] = files.back();
+    files[f->registry_index]->registry_index = f->registry_index;
+    files.pop_back();
+    mapped_bytes -= f->mapped_size;
+    count--;
+}
+
+// Measure how far ahead batched reads should prefetch, by timing
+// read_batch over random offsets into a buffer larger than most last level
+// caches at a few distances and keeping the fastest. Allocates 64MB and
+// takes around 100ms, so call it once at startup or from a
+// background thread, never from a thread that needs to stay responsive.
+// Prefetching batches on other threads use each trial distance meanwhile.
+void calibrate_prefetch_distance() {
+    std::vector<int64_t> buffer((64 << 20) / sizeof(int64_t), 1);
+    file f(buffer.size() * sizeof(int64_t), buffer.data());
+
+    const size_t count = 1 << 18;
+    std::mt19937 rng(count);
+    std::vector<size_t> offsets(count);
+    for (size_t& offset : offsets)
+        offset = rng() % buffer.size() * sizeof(int64_t);
+
+    std::vector<int64_t> results(count);
+    std::unique_ptr<bool[]> ok(new bool[count]);
+
+    size_t best = prefetch_distance();
+    double best_ns = 0;
+    for (size_t distance : {2, 4, 8, 16, 32, 64}) {
+        prefetch_distance_items.store(distance, std::memory_order_relaxed);
+
+        // Keep the faster of two runs, the first may still be faulting in
+        // the results
+        double ns = 0;
+        for (int run = 0; run < 2; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            f.read_batch(
+                offsets.data(), count, results.data(), ok.get(),
+                batch_prefetch);
+            auto end = std::chrono::steady_clock::now();
+
+            double elapsed =
+                std::chrono::duration<double, std::nano>(end - start).count();
+            if (run == 0 || elapsed < ns)
+                ns = elapsed;
+        }
+
+        if (best_ns == 0 || ns < best_ns) {
+            best = distance;
+            best_ns = ns;
+        }
+    }
+
+    prefetch_distance_items.store(best, std::memory_order_relaxed);
+}
+
+// How open_file maps a file
+struct open_options {
+    // Place the mapping on a huge page boundary and ask for transparent huge
+    // pages, where the kernel supports them for file mappings. Cuts dTLB
+    // misses for random reads across large files.
+    bool huge_pages = false;
+
+    // Copy the file into anonymous memory backed by huge pages instead of
+    // mapping it, using hugetlbfs pages if any are reserved and transparent
+    // huge pages if not. Changes to the file after opening aren't seen.
+    bool copy_to_huge_pages = false;
 };
 
 #if defined(_WIN32)
@@ -123,7 +983,11 @@ struct windows_file : public file {
     }
 };
 
-file* open_file(const char * path) {
+file* open_file(
+        const char * path, const open_options& options = open_options()) {
+    // Huge page options aren't supported here
+    (void)options;
+
     // Create a normal file handle
     HANDLE f = CreateFile(
         path,
@@ -168,47 +1032,4666 @@ file* open_file(const char * path) {
 }
 #else
 struct posix_file : public file {
-    using file::file;
+    int fd;
+
+    posix_file(int f, size_t s, void* d) : file(s, d), fd(f) {
+    }
+
+    posix_file(int f, size_t s, void* d, size_t m) : file(s, d, m), fd(f) {
+    }
 
     virtual ~posix_file() {
-        munmap((void*)data, size);
+        munmap((void*)data, mapped_size);
+        close(fd);
     }
 };
 
-file* open_file(const char * path) {
-    // Stat the file to get the size for later
-    struct stat64 st;
+const size_t huge_page_size = 2 << 20;
 
-    if (stat64(path, &st))
+// Reserve size bytes of address space starting on a huge page boundary
+static void* reserve_huge_aligned(size_t size) {
+    size_t padded = size + huge_page_size;
+    void* reserved = mmap(
+        NULL, padded, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED)
         return nullptr;
 
-    // Open the file in read only mode
-    int fd = open(path, O_RDONLY);
-    if (fd < 0)
-        return nullptr;
+    // Give back the slack either side of the aligned range
+    uintptr_t start = (uintptr_t)reserved;
+    uintptr_t aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+    if (aligned > start)
+        munmap(reserved, aligned - start);
+    if (start + padded > aligned + size)
+        munmap((void*)(aligned + size), start + padded - aligned - size);
 
-    // Allocate a buffer for the file contents
-    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return (void*)aligned;
+}
 
-    // mmap returns MAP_FAILED on error, not NULL
-    if (data == MAP_FAILED)
-        return nullptr;
+// Copy a file into anonymous huge page memory
+static file* copy_fd_to_huge_pages(int fd, size_t size) {
+    size_t rounded = (size + huge_page_size - 1) & ~(huge_page_size - 1);
 
-    // Construct a new file with the data
-    return new posix_file(st.st_size, data);
-}
+    void* data = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    data = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
 #endif
 
-int main(int argc, char const *argv[]) {
-    // Assume we're given 1 argument
-    if (argc != 2) {
-        return 1;
+    // No hugetlbfs pages reserved, fall back to transparent huge pages
+    if (data == MAP_FAILED) {
+        data = reserve_huge_aligned(rounded);
+        if (!data || mmap(data, rounded, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            if (data)
+                munmap(data, rounded);
+            close(fd);
+            return nullptr;
+        }
+#if defined(MADV_HUGEPAGE)
+        madvise(data, rounded, MADV_HUGEPAGE);
+#endif
+    }
+
+    // Read with pread rather than through a mapping, so a truncated file
+    // is an error here rather than a fault
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, (int8_t*)data + done, size - done, done);
+        if (n <= 0) {
+            munmap(data, rounded);
+            close(fd);
+            return nullptr;
+        }
+        done += n;
+    }
+
+    mprotect(data, rounded, PROT_READ);
+    return new posix_file(fd, size, data, rounded);
+}
+
+// Map an already opened file descriptor, taking ownership of it
+static file* map_fd(int fd, const open_options& options = open_options()) {
+    // Stat through the descriptor so the path is only resolved once
+    struct stat64 st;
+
+    if (fstat64(fd, &st)) {
+        close(fd);
+        return nullptr;
+    }
+
+    if (options.copy_to_huge_pages)
+        return copy_fd_to_huge_pages(fd, st.st_size);
+
+    void* data;
+    if (options.huge_pages) {
+        // Map over an aligned reservation so huge pages can line up
+        void* reserved = reserve_huge_aligned(st.st_size);
+        data = reserved ? mmap(reserved, st.st_size, PROT_READ,
+            MAP_PRIVATE | MAP_FIXED, fd, 0) : MAP_FAILED;
+        if (data == MAP_FAILED && reserved)
+            munmap(reserved, st.st_size);
+#if defined(MADV_HUGEPAGE)
+        if (data != MAP_FAILED)
+            madvise(data, st.st_size, MADV_HUGEPAGE);
+#endif
+    } else {
+        // Allocate a buffer for the file contents
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // mmap returns MAP_FAILED on error, not NULL
+    if (data == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+
+    // Construct a new file with the data
+    return new posix_file(fd, st.st_size, data);
+}
+
+file* open_file(
+        const char * path, const open_options& options = open_options()) {
+    // Open the file in read only mode
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    return map_fd(fd, options);
+}
+
+// When a writable_file starts writing back what has been written to it
+struct sync_options {
+    // Start writeback once this many bytes are dirty, 0 to not count bytes
+    size_t bytes = 8 << 20;
+
+    // Start writeback once this long has passed since the last, 0 to not
+    // check the time. There's no timer, the time is only checked on writes
+    // and by writable_file::sync_if_due, so a file that stops being written
+    // to isn't written back until one of those or its destruction.
+    std::chrono::milliseconds interval{1000};
+};
+
+// A file mapped shared and writable, such as a cache or index being built.
+// Stores are guarded the same as reads, so running out of disk space or the
+// file being truncated fails the write rather than raising SIGBUS. Rather
+// than a syscall per write, writeback of the range written to is started in
+// batches. Not safe to write from several threads at once.
+struct writable_file : public posix_file {
+    sync_options options;
+
+    // Range written to since writeback was last started
+    size_t dirty_begin = SIZE_MAX;
+    size_t dirty_end = 0;
+    std::chrono::steady_clock::time_point last_sync;
+
+    writable_file(int f, size_t s, void* d, const sync_options& o)
+        : posix_file(f, s, d), options(o),
+          last_sync(std::chrono::steady_clock::now()) {
+    }
+
+    virtual ~writable_file() {
+        sync(false);
+    }
+
+    // Write a 64 bit integer at the byte offset
+    bool write(size_t offset, int64_t value) {
+        return write_bytes(offset, &value, sizeof(value));
+    }
+
+    // Write length bytes at the byte offset
+    bool write_bytes(size_t offset, const void* bytes, size_t length) {
+        // Out of bounds check
+        assert(offset <= size && length <= size - offset);
+
+        bool success = safe_mmap_try([&]() {
+            memcpy((int8_t*)data + offset, bytes, length);
+        });
+
+        mark_dirty(offset, length);
+        return success;
+    }
+
+    // Note a range written to directly through data, starting writeback if
+    // enough has been written
+    void mark_dirty(size_t offset, size_t length) {
+        dirty_begin = std::min(dirty_begin, offset);
+        dirty_end = std::max(dirty_end, offset + length);
+
+        if (options.bytes && dirty_end - dirty_begin >= options.bytes)
+            sync(false);
+        else
+            sync_if_due();
+    }
+
+    // Start writeback if anything is dirty and the interval has passed.
+    // Call this from an idle handler or timer on the writing thread so
+    // files that stop being written to are still written back in time.
+    bool sync_if_due() {
+        if (dirty_begin >= dirty_end || !options.interval.count() ||
+                std::chrono::steady_clock::now() - last_sync < options.interval)
+            return true;
+        return sync(false);
+    }
+
+    // Start writing back the range written to since the last writeback.
+    // With wait, returns once everything written so far is on disk,
+    // including ranges whose writeback was only started.
+    bool sync(bool wait) {
+        last_sync = std::chrono::steady_clock::now();
+
+        size_t begin = dirty_begin;
+        size_t end = dirty_end;
+        dirty_begin = SIZE_MAX;
+        dirty_end = 0;
+
+        if (wait)
+            return msync((void*)data, size, MS_SYNC) == 0;
+
+        if (begin >= end)
+            return true;
+
+#if defined(__linux__)
+        return sync_file_range(
+            fd, begin, end - begin, SYNC_FILE_RANGE_WRITE) == 0;
+#else
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t aligned = begin & ~(page - 1);
+        return msync(
+            (int8_t*)data + aligned, end - aligned, MS_ASYNC) == 0;
+#endif
+    }
+};
+
+// Open or create a file for writing through a mapping. Space for size bytes
+// is allocated up front so writes within it won't fail for lack of space.
+writable_file* open_writable_file(
+        const char * path, size_t size,
+        const sync_options& options = sync_options()) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+
+    // posix_fallocate returns the error rather than setting errno
+    if (posix_fallocate(fd, 0, size) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void* data = mmap(
+        NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (data == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+
+    return new writable_file(fd, size, data, options);
+}
+
+// Build a file of size bytes at path, with fill(out) writing the contents
+// and returning whether it succeeded. The file is built and synced under a
+// temporary name next to path then renamed into place, so readers see the
+// old file or the complete new one, never a partial build.
+template<typename F>
+bool build_file(const char * path, size_t size, F fill) {
+    std::string temporary = std::string(path) + ".tmp";
+
+    unlink(temporary.c_str());
+    writable_file* out = open_writable_file(
+        temporary.c_str(), size, sync_options{0, {}});
+    if (!out)
+        return false;
+
+    // Make sure the new file is on disk before it replaces the old
+    bool success = fill(out) && out->sync(true);
+    delete out;
+
+    if (!success || rename(temporary.c_str(), path) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+#endif
+
+// A directory that files can be opened relative to, such as the objects/
+// directory of a repository. Opening relative to a cached handle means the
+// kernel only has to resolve the last few path components for each file.
+struct directory {
+#if defined(_WIN32)
+    std::string path;
+
+    directory(const char * p) : path(p) {
+        if (!path.empty() && path.back() != '\\' && path.back() != '/')
+            path += '\\';
+    }
+#else
+    int fd;
+
+    directory(int f) : fd(f) {
+    }
+
+    ~directory() {
+        close(fd);
+    }
+#endif
+};
+
+directory* open_directory(const char * path) {
+#if defined(_WIN32)
+    DWORD attributes = GetFileAttributes(path);
+    if (attributes == INVALID_FILE_ATTRIBUTES ||
+            !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+        return nullptr;
+
+    return new directory(path);
+#else
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    return new directory(fd);
+#endif
+}
+
+// Open a file relative to a directory handle
+file* open_file_at(
+        directory* dir, const char * name,
+        const open_options& options = open_options()) {
+#if defined(_WIN32)
+    return open_file((dir->path + name).c_str(), options);
+#else
+    int fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    return map_fd(fd, options);
+#endif
+}
+
+// Open many files relative to the same directory. Files that fail to open
+// are left as nullptr in results, returns the number successfully opened.
+size_t open_files_at(
+        directory* dir, const char * const * names, size_t count,
+        file** results, const open_options& options = open_options()) {
+    size_t opened = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        results[i] = open_file_at(dir, names[i], options);
+        if (results[i])
+            ++opened;
+    }
+
+    return opened;
+}
+
+// A small pool of threads for reads that may block on disk
+struct read_pool {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    read_pool(size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            threads.emplace_back([this]() { run(); });
+    }
+
+    ~read_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    void run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    // The shared pool, started on first use
+    static read_pool& get() {
+        static read_pool pool(4);
+        return pool;
+    }
+};
+
+enum read_error {
+    read_ok,
+
+    // The range extends past the end of the file
+    read_out_of_range,
+
+    // Reading faulted, the file was likely truncated or the disk failed
+    read_fault,
+};
+
+struct read_result {
+    read_error error;
+    std::vector<uint8_t> data;
+};
+
+// Awaitable returned by file::async_read. If every page of the range is
+// resident the read completes without suspending. Otherwise the coroutine
+// suspends, the read is done on the read pool and the coroutine is resumed
+// on that thread. Faults are reported in the result rather than raised.
+struct async_read_op {
+    file* f;
+    size_t offset;
+    size_t length;
+    read_result result;
+
+    void read() {
+        if (offset > f->size || length > f->size - offset) {
+            result.error = read_out_of_range;
+            return;
+        }
+
+        result.data.resize(length);
+        if (f->read_bytes(offset, length, result.data.data())) {
+            result.error = read_ok;
+        } else {
+            result.error = read_fault;
+            result.data.clear();
+        }
+    }
+
+    bool await_ready() {
+        if (offset > f->size || length > f->size - offset ||
+                f->is_resident(offset, length)) {
+            read();
+            return true;
+        }
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        read_pool::get().submit([this, handle]() {
+            read();
+            handle.resume();
+        });
+    }
+
+    read_result await_resume() {
+        return std::move(result);
+    }
+};
+
+inline async_read_op file::async_read(size_t offset, size_t length) {
+    return async_read_op{this, offset, length, {}};
+}
+
+enum task_priority {
+    priority_normal,
+
+    // Run ahead of normal tasks submitted from outside the pool
+    priority_high,
+};
+
+// Counts the outstanding tasks spawned into it, so they can be joined
+struct task_group {
+    std::atomic<size_t> pending{0};
+
+    // Lets threads outside the pool sleep until pending reaches zero
+    std::mutex mutex;
+    std::condition_variable done;
+
+    // Tasks still touching the group after finishing, the group mustn't
+    // be destroyed until they're through
+    std::atomic<size_t> finishing{0};
+};
+
+struct pool_task {
+    std::function<void()> fn;
+    task_group* group;
+};
+
+// A Chase-Lev work stealing deque. The owning worker pushes and takes from
+// the bottom without locking, other workers steal from the top. Following
+// "Correct and Efficient Work-Stealing for Weak Memory Models", Lê et al.
+struct work_deque {
+    struct ring {
+        int64_t mask;
+        std::unique_ptr<std::atomic<pool_task*>[]> items;
+
+        ring(int64_t capacity)
+            : mask(capacity - 1), items(new std::atomic<pool_task*>[capacity]) {
+        }
+
+        pool_task* get(int64_t i) {
+            return items[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, pool_task* task) {
+            items[i & mask].store(task, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<int64_t> top{0};
+    std::atomic<int64_t> bottom{0};
+    std::atomic<ring*> array;
+
+    // Rings replaced by growing, a thief may still be reading from them so
+    // they're kept until the deque is destroyed. Only touched by the owner.
+    std::vector<std::unique_ptr<ring>> rings;
+
+    work_deque() {
+        rings.emplace_back(new ring(256));
+        array.store(rings.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only
+    void push(pool_task* task) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        ring* a = array.load(std::memory_order_relaxed);
+
+        if (b - t > a->mask) {
+            ring* grown = new ring((a->mask + 1) * 2);
+            for (int64_t i = t; i < b; ++i)
+                grown->put(i, a->get(i));
+
+            rings.emplace_back(grown);
+            array.store(grown, std::memory_order_release);
+            a = grown;
+        }
+
+        a->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only
+    pool_task* take() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        ring* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            // Empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        pool_task* task = a->get(b);
+        if (t == b) {
+            // The last item, race any thieves for it
+            if (!top.compare_exchange_strong(
+                    t, t + 1, std::memory_order_seq_cst,
+                    std::memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Any thread. Returns nullptr if empty or another thread won the race.
+    pool_task* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return nullptr;
+
+        ring* a = array.load(std::memory_order_acquire);
+        pool_task* task = a->get(t);
+        if (!top.compare_exchange_strong(
+                t, t + 1, std::memory_order_seq_cst,
+                std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+};
+
+// A work stealing pool for CPU bound tasks such as scans, inflates and
+// hashing. Tasks spawned from a worker go on that worker's own deque, idle
+// workers steal from the others. Workers are ready to use safe_mmap_try.
+//
+// Blocking reads belong on the read_pool instead, so they don't hold up
+// workers.
+struct thread_pool {
+    struct worker {
+        work_deque deque;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+
+    // Tasks submitted from outside the pool, one queue per priority
+    std::mutex mutex;
+    std::deque<pool_task*> injected[2];
+    std::atomic<size_t> injected_count{0};
+
+    // Workers sleep on wake when there's nothing to do. Spawning bumps
+    // work_epoch and only takes the mutex to notify if a worker is asleep.
+    // A worker reads the epoch before looking for work and only sleeps if
+    // it's unchanged, so a task spawned meanwhile can't be missed.
+    std::condition_variable wake;
+    std::atomic<uint64_t> work_epoch{0};
+    std::atomic<size_t> sleeping{0};
+    std::atomic<bool> stopping{false};
+
+    // Worker the current thread belongs to, if any
+    static thread_local worker* current_worker;
+    static thread_local thread_pool* current_pool;
+
+    thread_pool(size_t count = std::thread::hardware_concurrency(),
+            bool pin = false) {
+        install_signal_handlers();
+
+        count = std::max<size_t>(count, 1);
+        for (size_t i = 0; i < count; ++i)
+            workers.emplace_back(new worker());
+
+        for (size_t i = 0; i < count; ++i) {
+            worker* w = workers[i].get();
+            w->thread = std::thread([this, w]() { run(w); });
+
+#if defined(__linux__)
+            // One worker per core
+            if (pin) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(i % CPU_SETSIZE, &set);
+                pthread_setaffinity_np(
+                    w->thread.native_handle(), sizeof(set), &set);
+            }
+#else
+            (void)pin;
+#endif
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (auto& w : workers)
+            w->thread.join();
+    }
+
+    // Run fn on the pool, optionally counting it in group
+    void spawn(
+            std::function<void()> fn, task_group* group = nullptr,
+            task_priority priority = priority_normal) {
+        if (group)
+            group->pending.fetch_add(1, std::memory_order_relaxed);
+
+        pool_task* task = new pool_task{std::move(fn), group};
+
+        // High priority tasks always go through the shared queue so idle
+        // workers check them before their own deques
+        if (current_pool == this && priority == priority_normal) {
+            current_worker->deque.push(task);
+        } else {
+            std::lock_guard<std::mutex> lock(mutex);
+            injected[priority].push_back(task);
+            injected_count.fetch_add(1, std::memory_order_release);
+        }
+
+        work_epoch.fetch_add(1);
+        if (sleeping.load() != 0) {
+            // Taking the lock means a worker that saw the old epoch is now
+            // waiting, rather than about to
+            std::lock_guard<std::mutex> lock(mutex);
+            wake.notify_one();
+        }
+    }
+
+    // Wait for every task in group to finish, running tasks meanwhile.
+    // Workers keep looking for tasks, other threads sleep once there are
+    // none left to run.
+    void wait(task_group& group) {
+        bool in_pool = current_pool == this;
+        while (group.pending.load(std::memory_order_acquire) != 0) {
+            pool_task* task = find_task(in_pool ? current_worker : nullptr);
+            if (task) {
+                execute(task);
+            } else if (in_pool) {
+                std::this_thread::yield();
+            } else {
+                std::unique_lock<std::mutex> lock(group.mutex);
+                group.done.wait(lock, [&]() {
+                    return group.pending.load(std::memory_order_acquire) == 0;
+                });
+            }
+        }
+
+        // The last task to finish may still be notifying
+        while (group.finishing.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+    }
+
+    // Call fn(begin, end) over subranges of [begin, end) no larger than
+    // grain, in parallel, returning once they're all done. The range is
+    // split in halves so thieves take the largest pieces.
+    template<typename F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F fn) {
+        task_group group;
+        split(group, begin, end, std::max<size_t>(grain, 1), fn);
+        wait(group);
+    }
+
+    // The shared pool with one worker per core, started on first use
+    static thread_pool& get() {
+        static thread_pool pool;
+        return pool;
+    }
+
+private:
+    template<typename F>
+    void split(task_group& group, size_t begin, size_t end, size_t grain,
+            F& fn) {
+        while (end - begin > grain) {
+            size_t middle = begin + (end - begin) / 2;
+            spawn([this, &group, middle, end, grain, &fn]() {
+                split(group, middle, end, grain, fn);
+            }, &group);
+            end = middle;
+        }
+
+        fn(begin, end);
+    }
+
+    pool_task* take_injected(task_priority priority) {
+        if (injected_count.load(std::memory_order_acquire) == 0)
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (injected[priority].empty())
+            return nullptr;
+
+        pool_task* task = injected[priority].front();
+        injected[priority].pop_front();
+        injected_count.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+    }
+
+    pool_task* find_task(worker* self) {
+        pool_task* task = take_injected(priority_high);
+
+        if (!task && self)
+            task = self->deque.take();
+
+        // Steal, starting from a different victim on each thread
+        if (!task) {
+            size_t start = std::hash<std::thread::id>()(
+                std::this_thread::get_id());
+            for (size_t i = 0; i < workers.size() && !task; ++i) {
+                worker* victim = workers[(start + i) % workers.size()].get();
+                if (victim != self)
+                    task = victim->deque.steal();
+            }
+        }
+
+        if (!task)
+            task = take_injected(priority_normal);
+
+        return task;
+    }
+
+    void execute(pool_task* task) {
+        task->fn();
+
+        task_group* group = task->group;
+        delete task;
+        if (!group)
+            return;
+
+        group->finishing.fetch_add(1, std::memory_order_relaxed);
+        if (group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(group->mutex);
+            group->done.notify_all();
+        }
+        group->finishing.fetch_sub(1, std::memory_order_release);
+    }
+
+    void run(worker* self) {
+        current_worker = self;
+        current_pool = this;
+
+#if !defined(_WIN32)
+        // Tasks may use safe_mmap_try, make sure SIGBUS reaches this thread
+        // and it starts without a jump point set
+        sigbus_jmp_set = false;
+
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGBUS);
+        pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+#endif
+
+        while (true) {
+            uint64_t epoch = work_epoch.load();
+            pool_task* task = find_task(self);
+            if (task) {
+                execute(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.fetch_add(1);
+            while (!stopping && work_epoch.load() == epoch)
+                wake.wait(lock);
+            sleeping.fetch_sub(1);
+
+            if (stopping)
+                return;
+        }
+    }
+};
+
+thread_local thread_pool::worker* thread_pool::current_worker = nullptr;
+thread_local thread_pool* thread_pool::current_pool = nullptr;
+
+// Lookups of keys in a file of sorted 64 bit integers, such as an index.
+// Each binary search is a chain of dependent cache misses, so rather than
+// running them one after another many are interleaved as coroutines. Each
+// lookup asks for its next probe and suspends, the probe is prefetched, and
+// the other lookups run while it arrives.
+enum lookup_status : uint8_t {
+    lookup_missing,
+    lookup_found,
+
+    // The file faulted while searching for the key
+    lookup_failed,
+};
+
+struct lookup_task {
+    struct promise_type {
+        // Offset of the value the lookup is waiting on
+        size_t offset;
+
+        // The value at offset, and whether it was read successfully
+        int64_t value;
+        bool ok;
+
+        lookup_task get_return_object() {
+            return lookup_task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit lookup_task(std::coroutine_handle<promise_type> h) : handle(h) {
+    }
+
+    lookup_task(lookup_task&& other) : handle(other.handle) {
+        other.handle = nullptr;
+    }
+
+    lookup_task& operator=(lookup_task&& other) {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+
+    ~lookup_task() {
+        if (handle)
+            handle.destroy();
+    }
+};
+
+// Await the value at a byte offset of the file being searched. Resumes with
+// a pointer to the value, or nullptr if reading it faulted.
+struct load_value {
+    size_t offset;
+    lookup_task::promise_type* promise = nullptr;
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<lookup_task::promise_type> h) {
+        promise = &h.promise();
+        promise->offset = offset;
+    }
+
+    const int64_t* await_resume() {
+        return promise->ok ? &promise->value : nullptr;
+    }
+};
+
+// Keys shared between the lookup coroutines, each takes the next key when
+// it finishes its current one so frames are reused across the batch
+struct lookup_queue {
+    const int64_t* keys;
+    size_t count;
+    size_t next;
+
+    // Number of values in the file
+    size_t values;
+
+    size_t* positions;
+    lookup_status* statuses;
+};
+
+static lookup_task lookup_worker(lookup_queue* queue) {
+    while (queue->next < queue->count) {
+        size_t i = queue->next++;
+        int64_t key = queue->keys[i];
+
+        // Find the last value not greater than key
+        size_t low = 0;
+        size_t n = queue->values;
+        const int64_t* value = nullptr;
+
+        while (n > 1) {
+            size_t half = n / 2;
+
+            value = co_await load_value{(low + half) * sizeof(int64_t)};
+            if (!value)
+                break;
+
+            if (*value <= key)
+                low += half;
+            n -= half;
+        }
+
+        if (n == 1)
+            value = co_await load_value{low * sizeof(int64_t)};
+
+        if (!value) {
+            queue->statuses[i] = lookup_failed;
+        } else if (*value == key) {
+            queue->statuses[i] = lookup_found;
+            queue->positions[i] = low;
+        } else {
+            queue->statuses[i] = lookup_missing;
+        }
+    }
+}
+
+// Find the index of each key in a file of sorted 64 bit integers, running
+// up to group lookups at once. Returns the number of keys found.
+size_t lookup_sorted(
+        file* f, const int64_t* keys, size_t count, size_t* positions,
+        lookup_status* statuses, size_t group = 16) {
+    lookup_queue queue = {
+        keys, count, 0, f->size / sizeof(int64_t), positions, statuses};
+
+    if (queue.values == 0) {
+        std::fill(statuses, statuses + count, lookup_missing);
+        return 0;
+    }
+
+    // Start the lookups, running each to its first probe
+    std::vector<lookup_task> tasks;
+    for (size_t i = 0; i < group && i < count; ++i) {
+        lookup_task task = lookup_worker(&queue);
+        task.handle.resume();
+
+        if (!task.handle.done()) {
+#if defined(__GNUC__)
+            __builtin_prefetch(
+                (int8_t*)f->data + task.handle.promise().offset);
+#endif
+            tasks.push_back(std::move(task));
+        }
+    }
+
+    std::vector<size_t> offsets;
+    std::vector<int64_t> values;
+    std::unique_ptr<bool[]> ok(new bool[tasks.size()]);
+
+    while (!tasks.empty()) {
+        // Every probe was prefetched a round ago, load them all in one go
+        offsets.resize(tasks.size());
+        values.resize(tasks.size());
+        for (size_t i = 0; i < tasks.size(); ++i)
+            offsets[i] = tasks[i].handle.promise().offset;
+
+        f->read_batch(offsets.data(), tasks.size(), values.data(), ok.get());
+
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            lookup_task::promise_type& promise = tasks[i].handle.promise();
+            promise.value = values[i];
+            promise.ok = ok[i];
+
+            tasks[i].handle.resume();
+
+#if defined(__GNUC__)
+            if (!tasks[i].handle.done())
+                __builtin_prefetch((int8_t*)f->data + promise.offset);
+#endif
+        }
+
+        tasks.erase(
+            std::remove_if(tasks.begin(), tasks.end(),
+                [](const lookup_task& task) { return task.handle.done(); }),
+            tasks.end());
+    }
+
+    return std::count(statuses, statuses + count, lookup_found);
+}
+
+// Aggregates over a range of 64 bit integers
+struct reduction {
+    // Sum wraps on overflow
+    int64_t sum = 0;
+    int64_t min = INT64_MAX;
+    int64_t max = INT64_MIN;
+    size_t count = 0;
+
+    // Counts of values in [low, high) when asked for. Buckets share a width
+    // rounded up from the range, so the last may be narrower or even empty.
+    // Values below low are counted in the first bucket and values at or
+    // above high in the bucket holding high - 1.
+    std::vector<size_t> histogram;
+
+    // Byte offsets of chunks that faulted, their values aren't included
+    std::vector<size_t> faulted_chunks;
+};
+
+struct histogram_options {
+    int64_t low;
+    int64_t high;
+    size_t buckets;
+};
+
+typedef void (*reduce_fn)(
+    const int64_t* values, size_t count, uint64_t* sum, int64_t* min,
+    int64_t* max);
+
+static void reduce_scalar(
+        const int64_t* values, size_t count, uint64_t* sum, int64_t* min,
+        int64_t* max) {
+    uint64_t s = *sum;
+    int64_t low = *min, high = *max;
+
+    for (size_t i = 0; i < count; ++i) {
+        s += (uint64_t)values[i];
+        low = std::min(low, values[i]);
+        high = std::max(high, values[i]);
+    }
+
+    *sum = s;
+    *min = low;
+    *max = high;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static void reduce_avx2(
+        const int64_t* values, size_t count, uint64_t* sum, int64_t* min,
+        int64_t* max) {
+    __m256i s = _mm256_setzero_si256();
+    __m256i low = _mm256_set1_epi64x(*min);
+    __m256i high = _mm256_set1_epi64x(*max);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(values + i));
+        s = _mm256_add_epi64(s, x);
+
+        // There's no 64 bit min/max before AVX-512, compare and blend
+        low = _mm256_blendv_epi8(low, x, _mm256_cmpgt_epi64(low, x));
+        high = _mm256_blendv_epi8(high, x, _mm256_cmpgt_epi64(x, high));
+    }
+
+    int64_t lanes[3][4];
+    _mm256_storeu_si256((__m256i*)lanes[0], s);
+    _mm256_storeu_si256((__m256i*)lanes[1], low);
+    _mm256_storeu_si256((__m256i*)lanes[2], high);
+
+    for (int j = 0; j < 4; ++j) {
+        *sum += (uint64_t)lanes[0][j];
+        *min = std::min(*min, lanes[1][j]);
+        *max = std::max(*max, lanes[2][j]);
+    }
+
+    reduce_scalar(values + i, count - i, sum, min, max);
+}
+
+__attribute__((target("avx512f")))
+static void reduce_avx512(
+        const int64_t* values, size_t count, uint64_t* sum, int64_t* min,
+        int64_t* max) {
+    __m512i s = _mm512_setzero_si512();
+    __m512i low = _mm512_set1_epi64(*min);
+    __m512i high = _mm512_set1_epi64(*max);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i x = _mm512_loadu_si512(values + i);
+        s = _mm512_add_epi64(s, x);
+        low = _mm512_mask_min_epi64(low, 0xff, low, x);
+        high = _mm512_mask_max_epi64(high, 0xff, high, x);
+    }
+
+    int64_t lanes[3][8];
+    _mm512_storeu_si512(lanes[0], s);
+    _mm512_storeu_si512(lanes[1], low);
+    _mm512_storeu_si512(lanes[2], high);
+
+    for (int j = 0; j < 8; ++j) {
+        *sum += (uint64_t)lanes[0][j];
+        *min = std::min(*min, lanes[1][j]);
+        *max = std::max(*max, lanes[2][j]);
+    }
+
+    reduce_scalar(values + i, count - i, sum, min, max);
+}
+#endif
+
+// Pick the widest reduction kernel the CPU supports
+static reduce_fn select_reduce() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const reduce_fn fn = []() -> reduce_fn {
+        if (__builtin_cpu_supports("avx512f"))
+            return &reduce_avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return &reduce_avx2;
+        return &reduce_scalar;
+    }();
+    return fn;
+#else
+    return &reduce_scalar;
+#endif
+}
+
+// Reduce one chunk of values into result, returns false if it faulted.
+// Nothing is added to result unless the whole chunk was read.
+static bool reduce_chunk(
+        const int64_t* values, size_t count,
+        const histogram_options* options, reduction& result) {
+    uint64_t sum = 0;
+    int64_t min = INT64_MAX, max = INT64_MIN;
+    std::vector<size_t> histogram(options ? options->buckets : 0);
+
+    bool success = safe_mmap_try([&]() {
+        select_reduce()(values, count, &sum, &min, &max);
+
+        if (options) {
+            // Width of each bucket, rounded up so high lands past the end.
+            // Rounding by adding buckets - 1 would overflow for wide ranges.
+            uint64_t range = (uint64_t)options->high - (uint64_t)options->low;
+            uint64_t buckets = options->buckets;
+            uint64_t width = std::max<uint64_t>(
+                1, range / buckets + (range % buckets != 0));
+
+            for (size_t i = 0; i < count; ++i) {
+                int64_t value = std::min(
+                    std::max(values[i], options->low), options->high - 1);
+                uint64_t bucket =
+                    ((uint64_t)value - (uint64_t)options->low) / width;
+                ++histogram[std::min(bucket, buckets - 1)];
+            }
+        }
+    });
+
+    if (!success)
+        return false;
+
+    result.sum = (int64_t)((uint64_t)result.sum + sum);
+    result.min = std::min(result.min, min);
+    result.max = std::max(result.max, max);
+    result.count += count;
+    for (size_t i = 0; i < histogram.size(); ++i)
+        result.histogram[i] += histogram[i];
+    return true;
+}
+
+// Reduce the 64 bit integers in [offset, offset + length) of a file. The
+// range is split into chunks reduced in parallel on the thread pool, chunks
+// that fault are skipped and reported in faulted_chunks.
+reduction reduce_file(
+        file* f, size_t offset, size_t length,
+        const histogram_options* options = nullptr,
+        size_t chunk_size = 1 << 20) {
+    // Out of bounds check
+    assert(offset <= f->size && length <= f->size - offset);
+    assert(!options || (options->buckets > 0 && options->low < options->high));
+
+    chunk_size = std::max(chunk_size / sizeof(int64_t), (size_t)1) *
+        sizeof(int64_t);
+
+    size_t values = length / sizeof(int64_t);
+    size_t per_chunk = chunk_size / sizeof(int64_t);
+    size_t chunks = (values + per_chunk - 1) / per_chunk;
+    const int64_t* base = (const int64_t*)((int8_t*)f->data + offset);
+
+    reduction result;
+    if (options)
+        result.histogram.resize(options->buckets);
+
+    std::mutex mutex;
+    thread_pool& pool = thread_pool::get();
+    pool.parallel_for(0, chunks, 1, [&](size_t begin, size_t end) {
+        reduction partial;
+        std::vector<size_t> faulted;
+        if (options)
+            partial.histogram.resize(options->buckets);
+
+        for (size_t chunk = begin; chunk < end; ++chunk) {
+            size_t first = chunk * per_chunk;
+            size_t count = std::min(per_chunk, values - first);
+
+            if (!reduce_chunk(base + first, count, options, partial))
+                faulted.push_back(offset + first * sizeof(int64_t));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        result.sum = (int64_t)((uint64_t)result.sum + (uint64_t)partial.sum);
+        result.min = std::min(result.min, partial.min);
+        result.max = std::max(result.max, partial.max);
+        result.count += partial.count;
+        for (size_t i = 0; i < partial.histogram.size(); ++i)
+            result.histogram[i] += partial.histogram[i];
+        result.faulted_chunks.insert(
+            result.faulted_chunks.end(), faulted.begin(), faulted.end());
+    });
+
+    std::sort(result.faulted_chunks.begin(), result.faulted_chunks.end());
+    return result;
+}
+
+// Search a large range in chunks in parallel on the thread pool. Chunks
+// past an earlier match are skipped. scanned gives the bytes before the
+// first fault, and faulted is set if that is before the match returned, in
+// which case an earlier match may have been missed.
+find_result find_parallel(
+        file* f, const void* needle, size_t needle_length, size_t offset,
+        size_t length, size_t chunk_size = 4 << 20) {
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    size_t chunks = (length + chunk_size - 1) / chunk_size;
+
+    std::atomic<size_t> best{SIZE_MAX};
+    std::atomic<size_t> first_fault{SIZE_MAX};
+
+    thread_pool& pool = thread_pool::get();
+    pool.parallel_for(0, chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t chunk = begin; chunk < end; ++chunk) {
+            size_t start = offset + chunk * chunk_size;
+            if (start >= best.load(std::memory_order_relaxed))
+                return;
+
+            find_result result = f->find(
+                needle, needle_length, start,
+                std::min(chunk_size, offset + length - start));
+
+            if (result.faulted) {
+                size_t at = start + result.scanned;
+                size_t current = first_fault.load();
+                while (at < current &&
+                        !first_fault.compare_exchange_weak(current, at)) {
+                }
+            }
+
+            size_t current = best.load();
+            while (result.offset < current &&
+                    !best.compare_exchange_weak(current, result.offset)) {
+            }
+        }
+    });
+
+    size_t fault = first_fault.load();
+    if (fault == SIZE_MAX)
+        return {best.load(), length, false};
+
+    return {best.load(), fault - offset, fault < best.load()};
+}
+
+// Matches many patterns at once in the style of Teddy. Patterns are spread
+// over 8 buckets, and for each of the first one or two bytes of a pattern a
+// pair of nibble tables gives the buckets with a pattern that can have that
+// byte there. ANDing the lookups for consecutive bytes leaves candidate
+// buckets for each position, which are then verified. With AVX2 the lookups
+// are pshufb over 32 positions at a time.
+struct multi_matcher {
+    std::vector<std::string> patterns;
+
+    // Number of leading bytes used to find candidates, 1 or 2
+    size_t prefix;
+
+    // Bucket bits by low and high nibble, for each prefix byte
+    alignas(16) uint8_t low_nibble[2][16];
+    alignas(16) uint8_t high_nibble[2][16];
+
+    // Pattern indices in each bucket
+    std::vector<uint32_t> buckets[8];
+
+    multi_matcher(std::vector<std::string> p) : patterns(std::move(p)) {
+        assert(!patterns.empty());
+
+        prefix = 2;
+        for (const std::string& pattern : patterns) {
+            assert(!pattern.empty());
+            prefix = std::min(prefix, pattern.size());
+        }
+
+        // Patterns sharing a prefix share a bucket, so sort before splitting
+        // them up to keep false candidates down
+        std::vector<uint32_t> order(patterns.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = (uint32_t)i;
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return patterns[a] < patterns[b];
+        });
+
+        memset(low_nibble, 0, sizeof(low_nibble));
+        memset(high_nibble, 0, sizeof(high_nibble));
+
+        for (size_t i = 0; i < order.size(); ++i) {
+            size_t bucket = i * 8 / order.size();
+            const std::string& pattern = patterns[order[i]];
+            buckets[bucket].push_back(order[i]);
+
+            for (size_t j = 0; j < prefix; ++j) {
+                uint8_t c = (uint8_t)pattern[j];
+                low_nibble[j][c & 0xf] |= 1 << bucket;
+                high_nibble[j][c >> 4] |= 1 << bucket;
+            }
+        }
+
+        // With one byte of prefix the second lookup must match anything
+        if (prefix == 1) {
+            memset(low_nibble[1], 0xff, 16);
+            memset(high_nibble[1], 0xff, 16);
+        }
+    }
+
+    // Candidate buckets for a pattern starting at data[i]
+    uint8_t candidates(const uint8_t* data, size_t i, size_t length) const {
+        uint8_t c = data[i];
+        uint8_t mask = low_nibble[0][c & 0xf] & high_nibble[0][c >> 4];
+
+        if (prefix == 2) {
+            if (i + 1 >= length)
+                return 0;
+
+            c = data[i + 1];
+            mask &= low_nibble[1][c & 0xf] & high_nibble[1][c >> 4];
+        }
+        return mask;
+    }
+
+    // Check the patterns in the candidate buckets at data[i], calling
+    // on_match(pattern, i) for each match. Returns false if on_match did.
+    template<typename F>
+    bool verify(
+            const uint8_t* data, size_t i, size_t length, uint8_t mask,
+            F& on_match) const {
+        for (int bucket = 0; mask; ++bucket, mask >>= 1) {
+            if (!(mask & 1))
+                continue;
+
+            for (uint32_t index : buckets[bucket]) {
+                const std::string& pattern = patterns[index];
+                if (pattern.size() <= length - i &&
+                        memcmp(data + i, pattern.data(), pattern.size()) == 0) {
+                    if (!on_match(index, i))
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Call on_match(pattern, position) for every match in data, stopping
+    // early if it returns false
+    template<typename F>
+    void scan(const uint8_t* data, size_t length, F on_match) const {
+        size_t i = 0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (__builtin_cpu_supports("avx2"))
+            i = scan_avx2(data, length, on_match);
+        if (i == SIZE_MAX)
+            return;
+#endif
+
+        for (; i < length; ++i) {
+            uint8_t mask = candidates(data, i, length);
+            if (mask && !verify(data, i, length, mask, on_match))
+                return;
+        }
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    // Scan whole blocks of 32 positions, returning where the scalar scan
+    // should continue or SIZE_MAX if on_match stopped the scan
+    template<typename F>
+    __attribute__((target("avx2")))
+    size_t scan_avx2(const uint8_t* data, size_t length, F& on_match) const {
+        const __m256i nibble = _mm256_set1_epi8(0xf);
+        __m256i low[2], high[2];
+        for (int j = 0; j < 2; ++j) {
+            low[j] = _mm256_broadcastsi128_si256(
+                _mm_load_si128((const __m128i*)low_nibble[j]));
+            high[j] = _mm256_broadcastsi128_si256(
+                _mm_load_si128((const __m128i*)high_nibble[j]));
+        }
+
+        size_t i = 0;
+        for (; i + 33 <= length; i += 32) {
+            __m256i mask = _mm256_set1_epi8((char)0xff);
+
+            for (int j = 0; j < 2; ++j) {
+                __m256i c = _mm256_loadu_si256((const __m256i*)(data + i + j));
+                __m256i l = _mm256_and_si256(c, nibble);
+                __m256i h = _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble);
+                mask = _mm256_and_si256(mask, _mm256_and_si256(
+                    _mm256_shuffle_epi8(low[j], l),
+                    _mm256_shuffle_epi8(high[j], h)));
+            }
+
+            uint32_t any = ~(uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(mask, _mm256_setzero_si256()));
+            if (!any)
+                continue;
+
+            alignas(32) uint8_t masks[32];
+            _mm256_store_si256((__m256i*)masks, mask);
+
+            while (any) {
+                int j = __builtin_ctz(any);
+                any &= any - 1;
+
+                if (!verify(data, i + j, length, masks[j], on_match))
+                    return SIZE_MAX;
+            }
+        }
+        return i;
+    }
+#endif
+};
+
+struct search_hit {
+    // Index of the file and pattern, and offset of the match in the file
+    size_t file;
+    size_t pattern;
+    size_t offset;
+
+    bool operator<(const search_hit& other) const {
+        return std::tie(file, offset, pattern) <
+            std::tie(other.file, other.offset, other.pattern);
+    }
+};
+
+struct search_results {
+    std::vector<search_hit> hits;
+
+    // Indices of files that faulted, only their hits before the fault are
+    // included
+    std::vector<size_t> faulted_files;
+};
+
+// Find every match of the matcher's patterns in each of files, searching
+// files in parallel on the thread pool. Hits are sorted by file and offset.
+search_results search_files(
+        file* const * files, size_t count, const multi_matcher& matcher) {
+    search_results results;
+    std::mutex mutex;
+
+    thread_pool::get().parallel_for(0, count, 1, [&](size_t begin, size_t end) {
+        std::vector<search_hit> hits;
+        std::vector<size_t> faulted;
+
+        for (size_t i = begin; i < end; ++i) {
+            file* f = files[i];
+
+            bool success = safe_mmap_try([&]() {
+                matcher.scan((const uint8_t*)f->data, f->size,
+                    [&](size_t pattern, size_t offset) {
+                        hits.push_back({i, pattern, offset});
+                        return true;
+                    });
+            });
+
+            if (!success)
+                faulted.push_back(i);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        results.hits.insert(results.hits.end(), hits.begin(), hits.end());
+        results.faulted_files.insert(
+            results.faulted_files.end(), faulted.begin(), faulted.end());
+    });
+
+    std::sort(results.hits.begin(), results.hits.end());
+    std::sort(results.faulted_files.begin(), results.faulted_files.end());
+    return results;
+}
+
+#if !defined(_WIN32)
+// An append-only log of variable length records, for events such as access
+// traces that are recorded too often for a syscall each. The file grows in
+// preallocated chunks, each mapped separately. Writers reserve space with a
+// fetch-add on the tail and copy records straight into the mapping.
+//
+// Each record is a 32 bit length word followed by the record, padded to 8
+// bytes. The word holds the length plus one so it's never zero, and it's
+// stored last with release ordering, so readers stop at a zero word, a
+// record that hasn't been committed yet. Records never cross a chunk
+// boundary, a reservation that would is turned into padding and retried.
+const uint32_t log_magic = 0x474f4c4d;
+
+// Length word for the rest of a chunk being padding
+const uint32_t log_chunk_padding = UINT32_MAX;
+
+// Set in a length word when the record is padding
+const uint32_t log_padding = 1u << 31;
+
+// Bytes taken by the header at the start of the log
+const size_t log_header_size = 8;
+
+static size_t log_record_size(size_t length) {
+    return (sizeof(uint32_t) + length + 7) & ~(size_t)7;
+}
+
+struct append_log {
+    int fd;
+    size_t chunk_size;
+
+    // Byte offset of the next reservation
+    std::atomic<size_t> tail{log_header_size};
+
+    // Mapping of each chunk, created on first use
+    static const size_t max_chunks = 1 << 16;
+    std::unique_ptr<std::atomic<int8_t*>[]> chunks;
+    std::mutex grow_mutex;
+
+    // Set once a reservation couldn't be written. Readers stop at it for
+    // good, so nothing more is appended.
+    std::atomic<bool> failed{false};
+
+    append_log(int f, size_t c)
+        : fd(f), chunk_size(c), chunks(new std::atomic<int8_t*>[max_chunks]) {
+        for (size_t i = 0; i < max_chunks; ++i)
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~append_log() {
+        for (size_t i = 0; i < max_chunks; ++i) {
+            int8_t* chunk = chunks[i].load(std::memory_order_relaxed);
+            if (chunk)
+                munmap(chunk, chunk_size);
+        }
+        close(fd);
+    }
+
+    // Mapping of a chunk, allocating and mapping it if needed
+    int8_t* chunk(size_t index) {
+        if (index >= max_chunks)
+            return nullptr;
+
+        int8_t* mapping = chunks[index].load(std::memory_order_acquire);
+        if (mapping)
+            return mapping;
+
+        std::lock_guard<std::mutex> lock(grow_mutex);
+        mapping = chunks[index].load(std::memory_order_relaxed);
+        if (mapping)
+            return mapping;
+
+        if (posix_fallocate(fd, index * chunk_size, chunk_size) != 0)
+            return nullptr;
+
+        void* data = mmap(
+            NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            index * chunk_size);
+        if (data == MAP_FAILED)
+            return nullptr;
+
+        chunks[index].store((int8_t*)data, std::memory_order_release);
+        return (int8_t*)data;
+    }
+
+    // Commit a length word, making everything before it visible to readers
+    static void commit(int8_t* at, uint32_t word) {
+        std::atomic_ref<uint32_t>(*(uint32_t*)at).store(
+            word, std::memory_order_release);
+    }
+
+    // Append a record, safe to call from many threads at once
+    bool append(const void* record, size_t length) {
+        size_t needed = log_record_size(length);
+        assert(length + 1 < log_padding &&
+            needed <= chunk_size - log_header_size);
+
+        while (true) {
+            if (failed.load(std::memory_order_relaxed))
+                return false;
+
+            size_t at = tail.fetch_add(needed, std::memory_order_relaxed);
+            size_t first = at / chunk_size;
+            size_t last = (at + needed - 1) / chunk_size;
+
+            int8_t* base = chunk(first);
+            int8_t* next = last != first ? chunk(last) : nullptr;
+            if (!base || (last != first && !next)) {
+                // Pad out what of the reservation is mapped, though readers
+                // will still stop at the start of the missing chunk
+                failed.store(true, std::memory_order_relaxed);
+                if (base) {
+                    safe_mmap_try([&]() {
+                        commit(base + at % chunk_size, log_chunk_padding);
+                    });
+                }
+                return false;
+            }
+
+            if (first == last) {
+                int8_t* p = base + at % chunk_size;
+                bool success = safe_mmap_try([&]() {
+                    memcpy(p + sizeof(uint32_t), record, length);
+                    commit(p, (uint32_t)length + 1);
+                });
+                if (!success)
+                    failed.store(true, std::memory_order_relaxed);
+                return success;
+            }
+
+            // The reservation straddles two chunks, pad out the end of
+            // this one and the start of the next, then try again
+            size_t spill = at + needed - last * chunk_size;
+            bool success = safe_mmap_try([&]() {
+                commit(next, log_padding |
+                    (uint32_t)(spill - sizeof(uint32_t)));
+                commit(base + at % chunk_size, log_chunk_padding);
+            });
+            if (!success) {
+                failed.store(true, std::memory_order_relaxed);
+                return false;
+            }
+        }
+    }
+};
+
+// Create a new, empty log. chunk_size is rounded up to a whole number of
+// pages.
+append_log* create_append_log(const char * path, size_t chunk_size = 1 << 20) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    chunk_size = std::max((chunk_size + page - 1) & ~(page - 1), page);
+    if (chunk_size > UINT32_MAX)
+        return nullptr;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+
+    append_log* log = new append_log(fd, chunk_size);
+
+    int8_t* header = log->chunk(0);
+    if (!header) {
+        delete log;
+        return nullptr;
+    }
+
+    uint32_t words[2] = {log_magic, (uint32_t)chunk_size};
+    memcpy(header, words, sizeof(words));
+    return log;
+}
+
+enum log_status {
+    log_record,
+
+    // No more committed records yet, try again later
+    log_empty,
+
+    // The log faulted or isn't valid
+    log_error,
+};
+
+// Reads records from a log, possibly while it's being appended to by this
+// or another process. Reads go through the guarded file path, remapping as
+// the log grows.
+struct log_reader {
+    int fd;
+    file* f = nullptr;
+    size_t chunk_size = 0;
+    size_t position = log_header_size;
+
+    log_reader(int d) : fd(d) {
+    }
+
+    ~log_reader() {
+        delete f;
+        close(fd);
+    }
+
+    // Map the log again if it has grown past the current mapping
+    bool remap() {
+        struct stat64 st;
+        if (fstat64(fd, &st))
+            return false;
+        if (f && (size_t)st.st_size <= f->size)
+            return true;
+
+        int d = dup(fd);
+        if (d < 0)
+            return false;
+
+        file* grown = map_fd(d);
+        if (!grown)
+            return false;
+
+        delete f;
+        f = grown;
+        return true;
+    }
+
+    // Read the length word at position
+    bool word(uint32_t* result) {
+        const int8_t* at = (const int8_t*)f->data + position;
+        return safe_mmap_try([&]() {
+            *result = std::atomic_ref<uint32_t>(*(uint32_t*)at).load(
+                std::memory_order_acquire);
+        });
+    }
+
+    log_status next(std::vector<uint8_t>& record) {
+        while (true) {
+            if (!f || position + sizeof(uint32_t) > f->size) {
+                if (!remap())
+                    return log_error;
+                if (position + sizeof(uint32_t) > f->size)
+                    return log_empty;
+            }
+
+            uint32_t length;
+            if (!word(&length))
+                return log_error;
+
+            if (length == 0)
+                return log_empty;
+
+            if (length == log_chunk_padding) {
+                position = (position / chunk_size + 1) * chunk_size;
+                continue;
+            }
+
+            if (length & log_padding) {
+                position += log_record_size(length & ~log_padding);
+                continue;
+            }
+
+            length -= 1;
+            record.resize(length);
+            if (position + sizeof(uint32_t) + length > f->size ||
+                    !f->read_bytes(
+                        position + sizeof(uint32_t), length, record.data()))
+                return log_error;
+
+            position += log_record_size(length);
+            return log_record;
+        }
+    }
+};
+
+log_reader* open_log_reader(const char * path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    log_reader* reader = new log_reader(fd);
+
+    uint32_t words[2];
+    if (!reader->remap() || reader->f->size < log_header_size ||
+            !reader->f->read_bytes(0, sizeof(words), words) ||
+            words[0] != log_magic || words[1] == 0) {
+        delete reader;
+        return nullptr;
+    }
+
+    reader->chunk_size = words[1];
+    return reader;
+}
+#endif
+
+#if !defined(_WIN32)
+// A persistent open addressing hash table from 20 byte object ids to 64 bit
+// values, served straight from the mapping so there's nothing to load at
+// startup. Entries are 32 bytes, two to a cache line, and probing is linear
+// so a lookup usually reads one or two lines.
+//
+// Tables are immutable once written. Changes are made by building a new
+// file from the old table plus the changes and renaming it over the old
+// one, so readers either see the old table or the new one.
+const size_t hash_key_size = 20;
+const uint32_t hash_table_magic = 0x48544d4d;
+const uint32_t hash_table_version = 1;
+
+struct hash_table_header {
+    uint32_t magic;
+    uint32_t version;
+
+    // Number of slots, a power of two, and how many are used
+    uint64_t capacity;
+    uint64_t count;
+    uint8_t padding[40];
+};
+
+struct hash_table_entry {
+    uint8_t key[hash_key_size];
+    uint32_t used;
+    uint64_t value;
+};
+
+static_assert(sizeof(hash_table_header) == 64, "header is one cache line");
+static_assert(sizeof(hash_table_entry) == 32, "two entries per cache line");
+
+// Object ids are already uniformly distributed, so use their leading bytes
+static uint64_t hash_key(const uint8_t* key) {
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+struct hash_table {
+    file* f;
+    uint64_t capacity;
+    uint64_t count;
+
+    ~hash_table() {
+        delete f;
+    }
+
+    const hash_table_entry* entries() const {
+        return (const hash_table_entry*)(
+            (const int8_t*)f->data + sizeof(hash_table_header));
+    }
+
+    // Find the value for key. Returns false if the table faulted, otherwise
+    // found says whether the key is present.
+    bool lookup(const uint8_t* key, uint64_t* value, bool* found) const {
+        const hash_table_entry* table = entries();
+        uint64_t mask = capacity - 1;
+        uint64_t slot = hash_key(key) & mask;
+
+        *found = false;
+        return safe_mmap_try([&]() {
+            for (uint64_t i = 0; i < capacity; ++i) {
+                const hash_table_entry& entry = table[(slot + i) & mask];
+                if (!entry.used)
+                    return;
+
+                if (memcmp(entry.key, key, hash_key_size) == 0) {
+                    *value = entry.value;
+                    *found = true;
+                    return;
+                }
+            }
+        });
+    }
+
+    // Call fn(key, value) for every entry. Returns false if it faulted.
+    template<typename F>
+    bool for_each(F fn) const {
+        const hash_table_entry* table = entries();
+        return safe_mmap_try([&]() {
+            for (uint64_t i = 0; i < capacity; ++i) {
+                if (table[i].used)
+                    fn(table[i].key, table[i].value);
+            }
+        });
+    }
+};
+
+hash_table* open_hash_table(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    hash_table_header header;
+    if (f->size < sizeof(header) ||
+            !f->read_bytes(0, sizeof(header), &header) ||
+            header.magic != hash_table_magic ||
+            header.version != hash_table_version ||
+            header.capacity == 0 ||
+            (header.capacity & (header.capacity - 1)) != 0 ||
+            header.capacity > (f->size - sizeof(header)) /
+                sizeof(hash_table_entry)) {
+        delete f;
+        return nullptr;
+    }
+
+    return new hash_table{f, header.capacity, header.count};
+}
+
+// Collects entries for a new table, optionally starting from an existing
+// one, and writes it out.
+struct hash_table_builder {
+    struct key_hash {
+        size_t operator()(const std::string& key) const {
+            return (size_t)hash_key((const uint8_t*)key.data());
+        }
+    };
+
+    std::unordered_map<std::string, uint64_t, key_hash> entries;
+
+    // Start from the entries of an existing table. Returns false if it
+    // faulted.
+    bool add_table(const hash_table& table) {
+        return table.for_each([&](const uint8_t* key, uint64_t value) {
+            entries[std::string((const char*)key, hash_key_size)] = value;
+        });
+    }
+
+    void set(const uint8_t* key, uint64_t value) {
+        entries[std::string((const char*)key, hash_key_size)] = value;
+    }
+
+    void remove(const uint8_t* key) {
+        entries.erase(std::string((const char*)key, hash_key_size));
+    }
+
+    // Write the table to path, atomically replacing any table already there
+    bool write(const char * path) const {
+        // Keep the load factor at or below a half so probes stay short
+        uint64_t capacity = 16;
+        while (capacity < entries.size() * 2)
+            capacity *= 2;
+
+        size_t size = sizeof(hash_table_header) +
+            capacity * sizeof(hash_table_entry);
+
+        return build_file(path, size, [&](writable_file* out) {
+            hash_table_header header = {};
+            header.magic = hash_table_magic;
+            header.version = hash_table_version;
+            header.capacity = capacity;
+            header.count = entries.size();
+
+            hash_table_entry* table = (hash_table_entry*)(
+                (int8_t*)out->data + sizeof(header));
+            uint64_t mask = capacity - 1;
+
+            // The file was just allocated so it's zeroed, all slots are
+            // unused
+            return out->write_bytes(0, &header, sizeof(header)) &&
+                safe_mmap_try([&]() {
+                    for (const auto& [key, value] : entries) {
+                        uint64_t slot =
+                            hash_key((const uint8_t*)key.data()) & mask;
+                        while (table[slot].used)
+                            slot = (slot + 1) & mask;
+
+                        memcpy(table[slot].key, key.data(), hash_key_size);
+                        table[slot].used = 1;
+                        table[slot].value = value;
+                    }
+                });
+        });
+    }
+};
+#endif
+
+#if !defined(_WIN32)
+// Sorted 64 bit integers in Eytzinger order, the order of a breadth first
+// walk of the implicit binary search tree. The first levels of the tree sit
+// together at the start of the file and the children of a node are next to
+// each other, so a search touches far fewer cache lines and pages than a
+// binary search, and the descendants a few levels down can be prefetched.
+//
+// The file holds n + 1 values. Value 0 is n, the tree uses 1 based indices
+// so the node at index k has children at 2k and 2k + 1.
+struct eytzinger_file {
+    file* f;
+    size_t count;
+
+    ~eytzinger_file() {
+        delete f;
+    }
+
+    const int64_t* values() const {
+        return (const int64_t*)f->data;
+    }
+
+    // Find the smallest value not less than key. Returns false if the file
+    // faulted, otherwise exists says whether there is such a value.
+    bool lower_bound(int64_t key, int64_t* result, bool* exists) const {
+        const int64_t* tree = values();
+        size_t n = count;
+        size_t k = 1;
+
+        return safe_mmap_try([&]() {
+            while (k <= n) {
+#if defined(__GNUC__)
+                // The 16 descendants four levels down share two cache lines
+                __builtin_prefetch(tree + std::min(k * 16, n));
+#endif
+                k = 2 * k + (tree[k] < key);
+            }
+
+            // Undo the right turns after the last left turn
+            k >>= __builtin_ffsll(~(long long)k);
+
+            *exists = k != 0;
+            if (k != 0)
+                *result = tree[k];
+        });
+    }
+
+    // Whether key is present. Returns false if the file faulted.
+    bool contains(int64_t key, bool* found) const {
+        int64_t value;
+        bool exists;
+        if (!lower_bound(key, &value, &exists))
+            return false;
+
+        *found = exists && value == key;
+        return true;
+    }
+};
+
+eytzinger_file* open_eytzinger_file(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    int64_t count;
+    if (f->size < sizeof(count) || !f->read(0, &count) || count < 0 ||
+            (uint64_t)count != f->size / sizeof(int64_t) - 1 ||
+            f->size % sizeof(int64_t) != 0) {
+        delete f;
+        return nullptr;
+    }
+
+    return new eytzinger_file{f, (size_t)count};
+}
+
+// The node after k in an in-order walk of a tree of n nodes
+static size_t eytzinger_next(size_t k, size_t n) {
+    if (2 * k + 1 <= n) {
+        // Leftmost node of the right subtree
+        k = 2 * k + 1;
+        while (2 * k <= n)
+            k *= 2;
+        return k;
+    }
+
+    // Climb while we're a right child, then once more to the parent
+    while (k & 1)
+        k >>= 1;
+    return k >> 1;
+}
+
+// Convert a file of sorted 64 bit integers into Eytzinger order. The input
+// is read sequentially by walking the tree in order.
+bool convert_to_eytzinger(file* sorted, const char * path) {
+    size_t n = sorted->size / sizeof(int64_t);
+
+    size_t size = (n + 1) * sizeof(int64_t);
+    return build_file(path, size, [&](writable_file* out) {
+        const int64_t* in = (const int64_t*)sorted->data;
+        int64_t* tree = (int64_t*)out->data;
+
+        return safe_mmap_try([&]() {
+            tree[0] = (int64_t)n;
+
+            size_t k = 1;
+            while (2 * k <= n)
+                k *= 2;
+
+            for (size_t i = 0; i < n; ++i) {
+                tree[k] = in[i];
+                k = eytzinger_next(k, n);
+            }
+        });
+    });
+}
+#endif
+
+#if !defined(_WIN32)
+// A static B+tree of 64 bit keys and values, built once by a bulk loader
+// and queried through the mapping. Nodes are whole pages. Leaves are
+// written first in key order and linked, so range scans stream through the
+// file, followed by each internal level up to the root.
+const size_t btree_page_size = 4096;
+const size_t btree_node_keys = 248;
+const uint32_t btree_magic = 0x42544d4d;
+
+struct btree_header {
+    uint32_t magic;
+    uint32_t height;
+    uint64_t count;
+    uint64_t root;
+    uint64_t first_leaf;
+};
+
+// Leaves hold values, internal nodes hold child page numbers. The keys of
+// an internal node are the first key under each child.
+struct btree_node {
+    uint32_t count;
+    uint32_t leaf;
+
+    // Next leaf page, 0 for the last leaf or an internal node
+    uint64_t next;
+
+    int64_t keys[btree_node_keys];
+    uint64_t values[btree_node_keys];
+};
+
+static_assert(sizeof(btree_node) <= btree_page_size, "nodes fit in a page");
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Count the keys less than key in whole vectors of 4, adding to rank.
+// Returns how many keys were looked at.
+__attribute__((target("avx2")))
+static size_t btree_rank_avx2(
+        const int64_t* keys, size_t count, int64_t key, size_t* rank) {
+    __m256i bound = _mm256_set1_epi64x(key);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i k = _mm256_loadu_si256((const __m256i*)(keys + i));
+        int mask = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(bound, k)));
+        *rank += __builtin_popcount(mask);
+    }
+    return i;
+}
+#endif
+
+// Number of keys in a node less than key
+static size_t btree_rank(const btree_node* node, int64_t key) {
+    size_t count = std::min<size_t>(node->count, btree_node_keys);
+    size_t rank = 0;
+    size_t i = 0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+        i = btree_rank_avx2(node->keys, count, key, &rank);
+#endif
+
+    for (; i < count; ++i)
+        rank += node->keys[i] < key;
+    return rank;
+}
+
+struct btree_file {
+    file* f;
+    btree_header header;
+
+    // Pages in the file, child and next page numbers are checked against
+    // this as they're read from the file
+    uint64_t pages;
+
+    ~btree_file() {
+        delete f;
+    }
+
+    // Node at page, or null if page isn't a node in the file or the node's
+    // count is out of range. Reads the node so must be guarded.
+    const btree_node* node(uint64_t page) const {
+        if (page == 0 || page >= pages)
+            return nullptr;
+
+        const btree_node* n = (const btree_node*)(
+            (const int8_t*)f->data + page * btree_page_size);
+        if (n->count > btree_node_keys)
+            return nullptr;
+        return n;
+    }
+
+    // Leaf holding the last key less than key, the first key not less than
+    // it is either in this leaf or at the start of the next. Null if the
+    // tree is corrupt.
+    const btree_node* find_leaf(int64_t key) const {
+        const btree_node* n = node(header.root);
+
+        // A corrupt tree could have cycles, never descend further than the
+        // height
+        for (uint32_t depth = 0; n && !n->leaf; ++depth) {
+            if (depth >= header.height || n->count == 0)
+                return nullptr;
+
+            size_t rank = btree_rank(n, key);
+            n = node(n->values[rank ? rank - 1 : 0]);
+        }
+        return n;
+    }
+
+    // Find the value for key. Returns false if the file faulted or is
+    // corrupt, otherwise found says whether key is present.
+    bool lookup(int64_t key, uint64_t* value, bool* found) const {
+        *found = false;
+        bool valid = true;
+        bool success = safe_mmap_try([&]() {
+            const btree_node* leaf = find_leaf(key);
+            if (!leaf) {
+                valid = false;
+                return;
+            }
+
+            size_t rank = btree_rank(leaf, key);
+            if (rank == leaf->count && leaf->next) {
+                leaf = node(leaf->next);
+                rank = 0;
+                if (!leaf) {
+                    valid = false;
+                    return;
+                }
+            }
+
+            if (rank < leaf->count && leaf->keys[rank] == key) {
+                *value = leaf->values[rank];
+                *found = true;
+            }
+        });
+        return success && valid;
+    }
+
+    // Call fn(key, value) for each key in [low, high] in order, until it
+    // returns false. Returns false if the file faulted or is corrupt.
+    template<typename F>
+    bool range(int64_t low, int64_t high, F fn) const {
+        bool valid = true;
+        bool success = safe_mmap_try([&]() {
+            const btree_node* leaf = find_leaf(low);
+            if (!leaf) {
+                valid = false;
+                return;
+            }
+            size_t i = btree_rank(leaf, low);
+
+            // A corrupt tree could link leaves in a cycle, no scan visits
+            // more leaves than there are pages
+            for (uint64_t visited = 0;; ++visited) {
+                for (; i < leaf->count; ++i) {
+                    if (leaf->keys[i] > high ||
+                            !fn(leaf->keys[i], leaf->values[i]))
+                        return;
+                }
+
+                if (!leaf->next)
+                    return;
+
+                uint64_t next = leaf->next;
+                leaf = node(next);
+                if (!leaf || visited >= pages) {
+                    valid = false;
+                    return;
+                }
+                i = 0;
+
+                // Leaves are consecutive pages, ask for the ones ahead in
+                // batches so they're read in before the scan gets there
+                if (next % 16 == 0) {
+                    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+                    size_t start = (next + 16) * btree_page_size;
+                    start &= ~(page_size - 1);
+                    if (start < f->size)
+                        madvise((int8_t*)f->data + start,
+                            std::min(16 * btree_page_size, f->size - start),
+                            MADV_WILLNEED);
+                }
+
+#if defined(__GNUC__)
+                if (leaf->next && leaf->next < pages)
+                    __builtin_prefetch(
+                        (const int8_t*)f->data + leaf->next * btree_page_size);
+#endif
+            }
+        });
+        return success && valid;
+    }
+};
+
+btree_file* open_btree_file(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    btree_header header;
+    size_t pages = f->size / btree_page_size;
+    if (f->size < btree_page_size ||
+            !f->read_bytes(0, sizeof(header), &header) ||
+            header.magic != btree_magic ||
+            header.height == 0 || header.height > 64 ||
+            header.root == 0 || header.root >= pages ||
+            header.first_leaf == 0 || header.first_leaf >= pages) {
+        delete f;
+        return nullptr;
+    }
+
+    return new btree_file{f, header, pages};
+}
+
+// Build a B+tree from count keys in ascending order and their values
+bool build_btree(
+        const char * path, const int64_t* keys, const uint64_t* values,
+        size_t count) {
+    // Work out how many nodes are on each level, leaves first
+    std::vector<size_t> levels;
+    size_t nodes = std::max<size_t>(
+        1, (count + btree_node_keys - 1) / btree_node_keys);
+    levels.push_back(nodes);
+    while (nodes > 1) {
+        nodes = (nodes + btree_node_keys - 1) / btree_node_keys;
+        levels.push_back(nodes);
+    }
+
+    size_t pages = 1;
+    for (size_t level : levels)
+        pages += level;
+
+    size_t size = pages * btree_page_size;
+    return build_file(path, size, [&](writable_file* out) {
+        auto node = [&](size_t page) {
+            return (btree_node*)(
+                (int8_t*)out->data + page * btree_page_size);
+        };
+
+        return safe_mmap_try([&]() {
+            // Fill the leaves
+            for (size_t i = 0; i < levels[0]; ++i) {
+                btree_node* leaf = node(1 + i);
+                size_t first = i * btree_node_keys;
+                leaf->leaf = 1;
+                leaf->count =
+                    (uint32_t)std::min(btree_node_keys, count - first);
+                leaf->next = i + 1 < levels[0] ? 2 + i : 0;
+
+                memcpy(leaf->keys, keys + first,
+                    leaf->count * sizeof(int64_t));
+                memcpy(leaf->values, values + first,
+                    leaf->count * sizeof(uint64_t));
+            }
+
+            // Each internal level points at the level below
+            size_t below = 1;
+            for (size_t level = 1; level < levels.size(); ++level) {
+                size_t start = below + levels[level - 1];
+
+                for (size_t i = 0; i < levels[level]; ++i) {
+                    btree_node* n = node(start + i);
+                    size_t first = i * btree_node_keys;
+                    n->count = (uint32_t)std::min(
+                        btree_node_keys, levels[level - 1] - first);
+
+                    for (size_t j = 0; j < n->count; ++j) {
+                        n->keys[j] = node(below + first + j)->keys[0];
+                        n->values[j] = below + first + j;
+                    }
+                }
+                below = start;
+            }
+
+            btree_header* header = (btree_header*)out->data;
+            header->magic = btree_magic;
+            header->height = (uint32_t)levels.size();
+            header->count = count;
+            header->root = pages - 1;
+            header->first_leaf = 1;
+        });
+    });
+}
+#endif
+
+#if !defined(_WIN32)
+// A blocked Bloom filter over object ids, kept as a sidecar file next to
+// the data it describes so that keys which aren't present can usually be
+// rejected without touching the data at all. All the bits for a key are in
+// one 64 byte block, so a probe reads a single cache line.
+const uint32_t bloom_magic = 0x424c4d4d;
+const size_t bloom_block_size = 64;
+
+struct bloom_header {
+    uint32_t magic;
+
+    // Bits set per key
+    uint32_t hashes;
+    uint64_t blocks;
+    uint64_t count;
+    uint8_t padding[40];
+};
+
+static_assert(sizeof(bloom_header) == bloom_block_size,
+    "blocks stay cache line aligned");
+
+// Block for a key and the bits to test within it. Object ids are already
+// uniformly distributed, so their bytes are used directly: the first 8 pick
+// the block and the next 8 seed the bit positions.
+static uint64_t bloom_block(const uint8_t* key, uint64_t blocks) {
+    return (uint64_t)(((unsigned __int128)hash_key(key) * blocks) >> 64);
+}
+
+template<typename F>
+static void bloom_bits(const uint8_t* key, uint32_t hashes, F fn) {
+    uint64_t h;
+    memcpy(&h, key + 8, sizeof(h));
+
+    for (uint32_t i = 0; i < hashes; ++i) {
+        h = h * 0x9e3779b97f4a7c15ull + 0x632be59bd9b4e019ull;
+
+        // The top 9 bits choose one of the 512 bits in the block
+        fn((size_t)(h >> 55));
+    }
+}
+
+struct bloom_filter {
+    file* f;
+    bloom_header header;
+
+    ~bloom_filter() {
+        delete f;
+    }
+
+    // Whether key may be present. Returns false if the file faulted.
+    bool may_contain(const uint8_t* key, bool* result) const {
+        const uint8_t* block = (const uint8_t*)f->data + bloom_block_size *
+            (1 + bloom_block(key, header.blocks));
+
+        return safe_mmap_try([&]() {
+            bool present = true;
+            bloom_bits(key, header.hashes, [&](size_t bit) {
+                present &= (block[bit / 8] >> (bit % 8)) & 1;
+            });
+            *result = present;
+        });
+    }
+};
+
+bloom_filter* open_bloom_filter(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    bloom_header header;
+    if (f->size < sizeof(header) ||
+            !f->read_bytes(0, sizeof(header), &header) ||
+            header.magic != bloom_magic || header.blocks == 0 ||
+            header.blocks > f->size / bloom_block_size - 1) {
+        delete f;
+        return nullptr;
+    }
+
+    return new bloom_filter{f, header};
+}
+
+// Build a filter for count keys of hash_key_size bytes each. About 10 bits
+// per key with 7 hashes gives a false positive rate around 1%.
+bool build_bloom_filter(
+        const char * path, const uint8_t* keys, size_t count,
+        size_t bits_per_key = 10, uint32_t hashes = 7) {
+    uint64_t blocks = std::max<uint64_t>(
+        1, (count * bits_per_key + 511) / 512);
+
+    size_t size = (blocks + 1) * bloom_block_size;
+    return build_file(path, size, [&](writable_file* out) {
+        return safe_mmap_try([&]() {
+            bloom_header* header = (bloom_header*)out->data;
+            header->magic = bloom_magic;
+            header->hashes = hashes;
+            header->blocks = blocks;
+            header->count = count;
+
+            for (size_t i = 0; i < count; ++i) {
+                const uint8_t* key = keys + i * hash_key_size;
+                uint8_t* block = (uint8_t*)out->data + bloom_block_size *
+                    (1 + bloom_block(key, blocks));
+
+                bloom_bits(key, hashes, [&](size_t bit) {
+                    block[bit / 8] |= 1 << (bit % 8);
+                });
+            }
+        });
+    });
+}
+#endif
+
+#if !defined(_WIN32)
+// A columnar container for integer and floating point columns. Each column
+// is stored contiguously, split into blocks of block_rows rows aligned to
+// 64 bytes, with the min and max of each block kept in a stats array so
+// scans can skip blocks that can't match. Only the columns a scan reads are
+// touched.
+//
+// Layout: header, column directory, then for each column its stats and its
+// values.
+const uint32_t columnar_magic = 0x4c434d4d;
+const size_t columnar_name_size = 32;
+
+enum column_type : uint32_t {
+    column_int32,
+    column_int64,
+    column_uint32,
+    column_uint64,
+    column_double,
+};
+
+template<typename T> struct column_type_of;
+template<> struct column_type_of<int32_t> {
+    static const column_type value = column_int32;
+};
+template<> struct column_type_of<int64_t> {
+    static const column_type value = column_int64;
+};
+template<> struct column_type_of<uint32_t> {
+    static const column_type value = column_uint32;
+};
+template<> struct column_type_of<uint64_t> {
+    static const column_type value = column_uint64;
+};
+template<> struct column_type_of<double> {
+    static const column_type value = column_double;
+};
+
+static size_t column_type_size(column_type type) {
+    switch (type) {
+    case column_int32:
+    case column_uint32:
+        return 4;
+    case column_int64:
+    case column_uint64:
+    case column_double:
+        return 8;
+    }
+    return 0;
+}
+
+struct columnar_header {
+    uint32_t magic;
+    uint32_t columns;
+    uint64_t rows;
+    uint64_t block_rows;
+    uint8_t padding[40];
+};
+
+struct column_entry {
+    char name[columnar_name_size];
+    uint32_t type;
+    uint32_t padding;
+
+    // Offset of the block stats, min then max per block as 8 byte slots
+    // holding a value of the column's type, and of the first value
+    uint64_t stats;
+    uint64_t values;
+    uint8_t padding2[8];
+};
+
+static_assert(sizeof(columnar_header) == 64, "directory stays aligned");
+static_assert(sizeof(column_entry) == 64, "directory stays aligned");
+
+static size_t align64(size_t offset) {
+    return (offset + 63) & ~(size_t)63;
+}
+
+// A column to be written, values points at rows values of type
+struct column_data {
+    std::string name;
+    column_type type;
+    const void* values;
+};
+
+template<typename T>
+static void column_block_stats(
+        const void* values, size_t begin, size_t end, uint8_t* stats) {
+    const T* v = (const T*)values;
+    T min = v[begin], max = v[begin];
+    for (size_t i = begin + 1; i < end; ++i) {
+        min = std::min(min, v[i]);
+        max = std::max(max, v[i]);
+    }
+    memcpy(stats, &min, sizeof(T));
+    memcpy(stats + 8, &max, sizeof(T));
+}
+
+bool build_columnar(
+        const char * path, const std::vector<column_data>& columns,
+        size_t rows, size_t block_rows = 8192) {
+    assert(block_rows > 0);
+
+    // Keep every block 64 byte aligned whatever the type size
+    block_rows = (block_rows + 15) & ~(size_t)15;
+    size_t blocks = (rows + block_rows - 1) / block_rows;
+
+    std::vector<column_entry> entries(columns.size());
+    size_t offset = align64(
+        sizeof(columnar_header) + columns.size() * sizeof(column_entry));
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        column_entry& entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+
+        if (columns[i].name.size() >= columnar_name_size)
+            return false;
+        memcpy(entry.name, columns[i].name.data(), columns[i].name.size());
+        entry.type = columns[i].type;
+
+        entry.stats = offset;
+        offset = align64(offset + blocks * 16);
+        entry.values = offset;
+        offset = align64(offset + rows * column_type_size(columns[i].type));
+    }
+
+    return build_file(path, offset, [&](writable_file* out) {
+        uint8_t* base = (uint8_t*)out->data;
+        return safe_mmap_try([&]() {
+            columnar_header* header = (columnar_header*)base;
+            header->magic = columnar_magic;
+            header->columns = (uint32_t)columns.size();
+            header->rows = rows;
+            header->block_rows = block_rows;
+            memcpy(base + sizeof(columnar_header), entries.data(),
+                entries.size() * sizeof(column_entry));
+
+            for (size_t i = 0; i < columns.size(); ++i) {
+                const column_data& column = columns[i];
+                memcpy(base + entries[i].values, column.values,
+                    rows * column_type_size(column.type));
+
+                for (size_t block = 0; block < blocks; ++block) {
+                    size_t begin = block * block_rows;
+                    size_t end = std::min(begin + block_rows, rows);
+                    uint8_t* stats = base + entries[i].stats + block * 16;
+
+                    switch (column.type) {
+                    case column_int32:
+                        column_block_stats<int32_t>(
+                            column.values, begin, end, stats);
+                        break;
+                    case column_int64:
+                        column_block_stats<int64_t>(
+                            column.values, begin, end, stats);
+                        break;
+                    case column_uint32:
+                        column_block_stats<uint32_t>(
+                            column.values, begin, end, stats);
+                        break;
+                    case column_uint64:
+                        column_block_stats<uint64_t>(
+                            column.values, begin, end, stats);
+                        break;
+                    case column_double:
+                        column_block_stats<double>(
+                            column.values, begin, end, stats);
+                        break;
+                    }
+                }
+            }
+        });
+    });
+}
+
+struct columnar_file {
+    file* f;
+    columnar_header header;
+    std::vector<column_entry> entries;
+
+    ~columnar_file() {
+        delete f;
+    }
+
+    // Index of the column with name, or -1 if there isn't one
+    int find_column(const char * name) const {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (strncmp(entries[i].name, name, columnar_name_size) == 0)
+                return (int)i;
+        }
+        return -1;
+    }
+
+    // The values of a column, which must be of type T. The span points into
+    // the mapping, so reading it must be done inside safe_mmap_try.
+    template<typename T>
+    std::span<const T> values(int column) const {
+        assert(entries[column].type == column_type_of<T>::value);
+        return std::span<const T>(
+            (const T*)((const int8_t*)f->data + entries[column].values),
+            header.rows);
+    }
+
+    // Call fn(first_row, values) for each block of a column whose stats
+    // overlap [low, high], skipping the rest. Returns false if it faulted.
+    template<typename T, typename F>
+    bool scan(int column, T low, T high, F fn) const {
+        std::span<const T> all = values<T>(column);
+        const uint8_t* stats =
+            (const uint8_t*)f->data + entries[column].stats;
+        size_t blocks = (header.rows + header.block_rows - 1) /
+            header.block_rows;
+
+        return safe_mmap_try([&]() {
+            for (size_t block = 0; block < blocks; ++block) {
+                T min, max;
+                memcpy(&min, stats + block * 16, sizeof(T));
+                memcpy(&max, stats + block * 16 + 8, sizeof(T));
+                if (max < low || min > high)
+                    continue;
+
+                size_t begin = block * header.block_rows;
+                size_t count = std::min<size_t>(
+                    header.block_rows, header.rows - begin);
+                fn(begin, all.subspan(begin, count));
+            }
+        });
+    }
+};
+
+columnar_file* open_columnar_file(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    columnar_file* c = new columnar_file{f, {}, {}};
+    columnar_header& header = c->header;
+
+    bool valid = f->size >= sizeof(header) &&
+        f->read_bytes(0, sizeof(header), &header) &&
+        header.magic == columnar_magic && header.block_rows > 0 &&
+        header.columns <= (f->size - sizeof(header)) / sizeof(column_entry);
+
+    if (valid) {
+        c->entries.resize(header.columns);
+        valid = f->read_bytes(sizeof(header),
+            header.columns * sizeof(column_entry), c->entries.data());
+    }
+
+    // Check every column's stats and values lie within the file
+    size_t blocks = valid ?
+        (header.rows + header.block_rows - 1) / header.block_rows : 0;
+    for (size_t i = 0; valid && i < c->entries.size(); ++i) {
+        const column_entry& entry = c->entries[i];
+        size_t type_size = entry.type <= column_double ?
+            column_type_size((column_type)entry.type) : 0;
+
+        valid = type_size != 0 &&
+            entry.stats <= f->size && blocks <= (f->size - entry.stats) / 16 &&
+            entry.values <= f->size &&
+            header.rows <= (f->size - entry.values) / type_size;
+    }
+
+    if (!valid) {
+        delete c;
+        return nullptr;
+    }
+    return c;
+}
+#endif
+
+#if !defined(_WIN32)
+// A container of independently deflated blocks with an index of where each
+// block starts, so a random read only inflates the one block holding it.
+// Recently inflated blocks are kept in a small cache.
+//
+// Layout: header, compressed blocks, then block count + 1 offsets, the last
+// being the end of the final block.
+const uint32_t compressed_magic = 0x5a434d4d;
+
+struct compressed_header {
+    uint32_t magic;
+    uint32_t block_size;
+
+    // Size of the uncompressed data, and offset of the block index
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t index;
+};
+
+bool build_compressed(
+        const char * path, const void* data, size_t size,
+        uint32_t block_size = 64 << 10, int level = Z_DEFAULT_COMPRESSION) {
+    assert(block_size > 0);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    uint64_t blocks = (size + block_size - 1) / block_size;
+    compressed_header header = {
+        compressed_magic, block_size, size, blocks, 0};
+
+    std::vector<uint64_t> offsets;
+    std::vector<uint8_t> block(compressBound(block_size));
+    std::vector<uint8_t> input(block_size);
+    uint64_t offset = sizeof(header);
+    bool success = true;
+
+    auto write_all = [&](const void* bytes, size_t length) {
+        const uint8_t* at = (const uint8_t*)bytes;
+        while (length > 0) {
+            ssize_t written = write(fd, at, length);
+            if (written <= 0)
+                return false;
+            at += written;
+            length -= written;
+        }
+        return true;
+    };
+
+    success = write_all(&header, sizeof(header));
+    for (uint64_t i = 0; success && i < blocks; ++i) {
+        size_t begin = i * block_size;
+        size_t length = std::min<size_t>(block_size, size - begin);
+
+        // The input may well be a mapping, copy it out under the guard
+        // rather than letting zlib fault part way through
+        success = safe_mmap_try([&]() {
+            memcpy(input.data(), (const uint8_t*)data + begin, length);
+        });
+
+        uLongf compressed = block.size();
+        success = success && compress2(
+            block.data(), &compressed, input.data(), length, level) == Z_OK;
+        success = success && write_all(block.data(), compressed);
+
+        offsets.push_back(offset);
+        offset += compressed;
+    }
+    offsets.push_back(offset);
+
+    header.index = offset;
+    success = success &&
+        write_all(offsets.data(), offsets.size() * sizeof(uint64_t)) &&
+        pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+
+    close(fd);
+    if (!success)
+        unlink(path);
+    return success;
+}
+
+struct compressed_file {
+    file* f;
+    compressed_header header;
+
+    // Inflated blocks, most recently used last
+    struct cached_block {
+        uint64_t index;
+        std::vector<uint8_t> data;
+    };
+
+    std::mutex mutex;
+    std::vector<cached_block> cache;
+    size_t cache_blocks;
+
+    compressed_file(file* c, const compressed_header& h, size_t blocks)
+        : f(c), header(h), cache_blocks(std::max<size_t>(blocks, 1)) {
+    }
+
+    ~compressed_file() {
+        delete f;
+    }
+
+    // Inflate a block into the cache, returning it or nullptr if the file
+    // faulted or the block is corrupt. Called with mutex held.
+    const std::vector<uint8_t>* block(uint64_t index) {
+        for (size_t i = 0; i < cache.size(); ++i) {
+            if (cache[i].index == index) {
+                std::rotate(cache.begin() + i, cache.begin() + i + 1,
+                    cache.end());
+                return &cache.back().data;
+            }
+        }
+
+        uint64_t range[2];
+        if (!f->read_bytes(header.index + index * sizeof(uint64_t),
+                sizeof(range), range) ||
+                range[0] > range[1] || range[1] > header.index)
+            return nullptr;
+
+        // Copy the compressed bytes out first so a fault can't leave zlib
+        // part way through
+        std::vector<uint8_t> compressed(range[1] - range[0]);
+        if (!f->read_bytes(range[0], compressed.size(), compressed.data()))
+            return nullptr;
+
+        size_t expected = std::min<uint64_t>(
+            header.block_size, header.size - index * header.block_size);
+        std::vector<uint8_t> data(expected);
+        uLongf length = data.size();
+        if (uncompress(data.data(), &length, compressed.data(),
+                compressed.size()) != Z_OK || length != expected)
+            return nullptr;
+
+        if (cache.size() >= cache_blocks)
+            cache.erase(cache.begin());
+        cache.push_back({index, std::move(data)});
+        return &cache.back().data;
+    }
+
+    // Copy length bytes of the uncompressed data at offset into out
+    bool read_bytes(size_t offset, size_t length, void* out) {
+        // Out of bounds check
+        assert(offset <= header.size && length <= header.size - offset);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        uint8_t* at = (uint8_t*)out;
+        while (length > 0) {
+            uint64_t index = offset / header.block_size;
+            size_t within = offset % header.block_size;
+
+            const std::vector<uint8_t>* data = block(index);
+            if (!data)
+                return false;
+
+            size_t count = std::min(length, data->size() - within);
+            memcpy(at, data->data() + within, count);
+            at += count;
+            offset += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    // Get a 64 bit integer at the byte offset of the uncompressed data
+    bool read(size_t offset, int64_t * result) {
+        return read_bytes(offset, sizeof(*result), result);
+    }
+
+    void clear_cache() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cache.clear();
+    }
+};
+
+compressed_file* open_compressed_file(
+        const char * path, size_t cache_blocks = 16) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    compressed_header header;
+    if (f->size < sizeof(header) ||
+            !f->read_bytes(0, sizeof(header), &header) ||
+            header.magic != compressed_magic || header.block_size == 0 ||
+            header.blocks != (header.size + header.block_size - 1) /
+                header.block_size ||
+            header.index > f->size ||
+            header.blocks >= (f->size - header.index) / sizeof(uint64_t)) {
+        delete f;
+        return nullptr;
+    }
+
+    return new compressed_file(f, header, cache_blocks);
+}
+#endif
+
+// Stream VByte coding of 32 bit integers. Values are stored in 1 to 4
+// bytes, with the lengths of each group of 4 packed into a separate
+// control byte so a whole group can be decoded with one pshufb. Sorted
+// sequences such as offsets or timestamps can be delta coded first so the
+// values stored are small.
+//
+// Encoded as the control bytes, one per 4 values, followed by the data.
+// Decoding may read up to 16 bytes past the end of the data, so buffers
+// should have varint_padding bytes spare.
+const size_t varint_padding = 16;
+
+static size_t varint_control_size(size_t count) {
+    return (count + 3) / 4;
+}
+
+// Append count values to control and data, delta coded if delta is set
+static void varint_encode(
+        const uint32_t* values, size_t count, bool delta,
+        std::vector<uint8_t>& control, std::vector<uint8_t>& data) {
+    control.assign(varint_control_size(count), 0);
+    data.clear();
+    data.reserve(count * 4);
+
+    uint32_t previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t value = delta ? values[i] - previous : values[i];
+        previous = values[i];
+
+        int bytes = value < (1u << 8) ? 1 :
+            value < (1u << 16) ? 2 :
+            value < (1u << 24) ? 3 : 4;
+        control[i / 4] |= (bytes - 1) << ((i % 4) * 2);
+
+        for (int j = 0; j < bytes; ++j)
+            data.push_back((uint8_t)(value >> (j * 8)));
+    }
+}
+
+// Decode one value, returning the number of data bytes it took
+static size_t varint_decode_one(
+        uint8_t control, size_t lane, const uint8_t* data, uint32_t* value) {
+    size_t bytes = ((control >> (lane * 2)) & 3) + 1;
+    uint32_t v = 0;
+    for (size_t j = 0; j < bytes; ++j)
+        v |= (uint32_t)data[j] << (j * 8);
+    *value = v;
+    return bytes;
+}
+
+// Data bytes the control bytes of count values say they take
+static uint64_t varint_data_size(const uint8_t* control, size_t count) {
+    uint64_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += ((control[i / 4] >> ((i % 4) * 2)) & 3) + 1;
+    return size;
+}
+
+static size_t varint_decode_scalar(
+        const uint8_t* control, const uint8_t* data, size_t count, bool delta,
+        uint32_t previous, uint32_t* out) {
+    const uint8_t* at = data;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t value;
+        at += varint_decode_one(control[i / 4], i % 4, at, &value);
+        previous = delta ? previous + value : value;
+        out[i] = previous;
+    }
+    return at - data;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Shuffle masks and data lengths for every control byte
+struct varint_tables {
+    alignas(16) uint8_t shuffle[256][16];
+    uint8_t length[256];
+
+    varint_tables() {
+        for (int control = 0; control < 256; ++control) {
+            int at = 0;
+            for (int lane = 0; lane < 4; ++lane) {
+                int bytes = ((control >> (lane * 2)) & 3) + 1;
+                for (int j = 0; j < 4; ++j)
+                    shuffle[control][lane * 4 + j] =
+                        j < bytes ? (uint8_t)at++ : 0x80;
+            }
+            length[control] = (uint8_t)at;
+        }
+    }
+};
+
+static const varint_tables& get_varint_tables() {
+    static const varint_tables tables;
+    return tables;
+}
+
+__attribute__((target("ssse3")))
+static size_t varint_decode_ssse3(
+        const uint8_t* control, const uint8_t* data, size_t count, bool delta,
+        uint32_t previous, uint32_t* out) {
+    const varint_tables& tables = get_varint_tables();
+    const uint8_t* at = data;
+    __m128i carry = _mm_set1_epi32((int)previous);
+
+    size_t groups = count / 4;
+    for (size_t g = 0; g < groups; ++g) {
+        uint8_t c = control[g];
+        __m128i bytes = _mm_loadu_si128((const __m128i*)at);
+        __m128i values = _mm_shuffle_epi8(
+            bytes, _mm_load_si128((const __m128i*)tables.shuffle[c]));
+        at += tables.length[c];
+
+        if (delta) {
+            // Prefix sum across the lanes, then add the last value so far
+            values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+            values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+            values = _mm_add_epi32(values, carry);
+            carry = _mm_shuffle_epi32(values, 0xff);
+        }
+
+        _mm_storeu_si128((__m128i*)(out + g * 4), values);
+    }
+
+    if (delta && groups > 0)
+        previous = out[groups * 4 - 1];
+
+    at += varint_decode_scalar(
+        control + groups, at, count - groups * 4, delta, previous,
+        out + groups * 4);
+    return at - data;
+}
+#endif
+
+// Decode count values, returning the number of data bytes used. previous
+// is the value before the first when delta coded.
+static size_t varint_decode(
+        const uint8_t* control, const uint8_t* data, size_t count, bool delta,
+        uint32_t previous, uint32_t* out) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("ssse3"))
+        return varint_decode_ssse3(control, data, count, delta, previous, out);
+#endif
+    return varint_decode_scalar(control, data, count, delta, previous, out);
+}
+
+#if !defined(_WIN32)
+const uint32_t varint_magic = 0x56534d4d;
+
+struct varint_header {
+    uint32_t magic;
+    uint32_t delta;
+    uint64_t count;
+    uint64_t data_size;
+};
+
+// Write values to a file as a Stream VByte stream
+bool write_varint_file(
+        const char * path, const uint32_t* values, size_t count, bool delta) {
+    std::vector<uint8_t> control, data;
+    varint_encode(values, count, delta, control, data);
+
+    varint_header header = {varint_magic, delta, count, data.size()};
+    size_t size = sizeof(header) + control.size() + data.size() +
+        varint_padding;
+
+    return build_file(path, size, [&](writable_file* out) {
+        return out->write_bytes(0, &header, sizeof(header)) &&
+            out->write_bytes(sizeof(header), control.data(), control.size()) &&
+            out->write_bytes(sizeof(header) + control.size(), data.data(),
+                data.size());
+    });
+}
+
+// Reads a Stream VByte stream, decoding straight out of the mapping
+struct varint_file {
+    file* f;
+    varint_header header;
+
+    ~varint_file() {
+        delete f;
+    }
+
+    const uint8_t* control() const {
+        return (const uint8_t*)f->data + sizeof(header);
+    }
+
+    const uint8_t* data() const {
+        return control() + varint_control_size(header.count);
+    }
+
+    // Decode every value. Returns false if the file faulted.
+    bool decode(std::vector<uint32_t>& out) const {
+        out.resize(header.count);
+        return safe_mmap_try([&]() {
+            varint_decode(control(), data(), header.count, header.delta, 0,
+                out.data());
+        });
+    }
+
+    // Call fn(first, values) for blocks of up to block values in order,
+    // decoding each into a reused buffer. Returns false if it faulted.
+    template<typename F>
+    bool for_each_block(F fn, size_t block = 4096) const {
+        // Blocks must be whole groups of 4 so each starts on a control byte
+        block = std::max<size_t>(block & ~(size_t)3, 4);
+        std::vector<uint32_t> buffer(block);
+
+        return safe_mmap_try([&]() {
+            const uint8_t* at = data();
+            uint32_t previous = 0;
+
+            for (size_t first = 0; first < header.count; first += block) {
+                size_t count = std::min<size_t>(block, header.count - first);
+                at += varint_decode(control() + first / 4, at, count,
+                    header.delta, previous, buffer.data());
+                previous = buffer[count - 1];
+                fn(first, std::span<const uint32_t>(buffer.data(), count));
+            }
+        });
+    }
+};
+
+varint_file* open_varint_file(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    varint_header header;
+    if (f->size < sizeof(header) ||
+            !f->read_bytes(0, sizeof(header), &header) ||
+            header.magic != varint_magic ||
+            varint_control_size(header.count) > f->size ||
+            header.data_size > f->size ||
+            sizeof(header) + varint_control_size(header.count) +
+                header.data_size + varint_padding > f->size) {
+        delete f;
+        return nullptr;
+    }
+
+    // Decoding trusts the control bytes, so they must account for exactly
+    // the data there is
+    uint64_t data_size = 0;
+    bool valid = safe_mmap_try([&]() {
+        data_size = varint_data_size(
+            (const uint8_t*)f->data + sizeof(header), header.count);
+    });
+    if (!valid || data_size != header.data_size) {
+        delete f;
+        return nullptr;
+    }
+
+    return new varint_file{f, header};
+}
+#endif
+
+#if !defined(_WIN32)
+// An immutable table of strings, such as paths, handing out 32 bit ids so
+// that parsers can compare ids rather than strings. Ids are the strings'
+// positions in sorted order, so comparing ids also compares the strings.
+// Strings are found by id through an offset array and by value through a
+// hash index, and are returned as views into the mapping without copying.
+//
+// Layout: header, count + 1 string offsets, the hash index of ids, then the
+// sorted strings back to back.
+const uint32_t string_table_magic = 0x54534d4d;
+const uint32_t string_table_missing = UINT32_MAX;
+
+struct string_table_header {
+    uint32_t magic;
+    uint32_t count;
+
+    // Slots in the hash index, a power of two
+    uint64_t slots;
+    uint64_t strings;
+    uint64_t strings_size;
+};
+
+// FNV-1a, paths are far from uniform so they need a real hash
+static uint64_t string_hash(std::string_view s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (char c : s) {
+        h ^= (uint8_t)c;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+struct string_table {
+    file* f;
+    string_table_header header;
+
+    ~string_table() {
+        delete f;
+    }
+
+    const uint64_t* offsets() const {
+        return (const uint64_t*)((const int8_t*)f->data + sizeof(header));
+    }
+
+    const uint32_t* index() const {
+        return (const uint32_t*)(offsets() + header.count + 1);
+    }
+
+    // Get the string with an id. Returns false if the table faulted or its
+    // offsets are corrupt. The view points into the mapping, so reading it
+    // must be done inside safe_mmap_try.
+    bool get(uint32_t id, std::string_view* s) const {
+        bool valid = false;
+        bool success = safe_mmap_try([&]() {
+            valid = view(id, s);
+        });
+        return success && valid;
+    }
+
+    // Find the id of a string. Returns false if the table faulted or is
+    // corrupt, otherwise id is string_table_missing if it isn't in the
+    // table.
+    bool find(std::string_view s, uint32_t* id) const {
+        const uint32_t* slots = index();
+        uint64_t mask = header.slots - 1;
+        uint64_t slot = string_hash(s) & mask;
+
+        *id = string_table_missing;
+        bool valid = true;
+        bool success = safe_mmap_try([&]() {
+            for (uint64_t i = 0; i < header.slots; ++i) {
+                uint32_t candidate = slots[(slot + i) & mask];
+                if (candidate == string_table_missing)
+                    return;
+
+                // Ids in the index come from the file
+                if (candidate >= header.count) {
+                    valid = false;
+                    return;
+                }
+
+                std::string_view candidate_string;
+                if (!view(candidate, &candidate_string)) {
+                    valid = false;
+                    return;
+                }
+                if (candidate_string == s) {
+                    *id = candidate;
+                    return;
+                }
+            }
+        });
+        return success && valid;
+    }
+
+private:
+    // get without the guard, for callers already inside safe_mmap_try.
+    // Returns false if the offsets are corrupt.
+    bool view(uint32_t id, std::string_view* s) const {
+        assert(id < header.count);
+
+        // The offsets come from the file
+        const uint64_t* o = offsets();
+        uint64_t begin = o[id];
+        uint64_t end = o[id + 1];
+        if (begin > end || end > header.strings_size)
+            return false;
+
+        *s = std::string_view(
+            (const char*)f->data + header.strings + begin, end - begin);
+        return true;
+    }
+};
+
+string_table* open_string_table(const char * path) {
+    file* f = open_file(path);
+    if (!f)
+        return nullptr;
+
+    // The offsets and index must fit before the strings. slots comes from
+    // the file so is divided rather than multiplied, which could overflow.
+    string_table_header header;
+    bool valid = f->size >= sizeof(header) &&
+        f->read_bytes(0, sizeof(header), &header) &&
+        header.magic == string_table_magic &&
+        header.slots > header.count &&
+        (header.slots & (header.slots - 1)) == 0 &&
+        header.strings <= f->size &&
+        header.strings_size <= f->size - header.strings;
+    if (valid) {
+        uint64_t offsets_end =
+            sizeof(header) + ((uint64_t)header.count + 1) * sizeof(uint64_t);
+        valid = offsets_end <= header.strings &&
+            header.slots <=
+                (header.strings - offsets_end) / sizeof(uint32_t);
+    }
+
+    // Every offset must stay within the strings, in order
+    valid = valid && safe_mmap_try([&]() {
+        const uint64_t* offsets = (const uint64_t*)(
+            (const int8_t*)f->data + sizeof(header));
+        for (uint32_t i = 0; valid && i < header.count; ++i)
+            valid = offsets[i] <= offsets[i + 1];
+        valid = valid && offsets[header.count] <= header.strings_size;
+    });
+
+    if (!valid) {
+        delete f;
+        return nullptr;
+    }
+
+    return new string_table{f, header};
+}
+
+// Write a table of strings, duplicates are only stored once
+bool write_string_table(const char * path, std::vector<std::string> strings) {
+    std::sort(strings.begin(), strings.end());
+    strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+    if (strings.size() >= string_table_missing)
+        return false;
+
+    // Keep the index at most half full
+    uint64_t slots = 16;
+    while (slots < strings.size() * 2)
+        slots *= 2;
+
+    std::vector<uint64_t> offsets(strings.size() + 1, 0);
+    for (size_t i = 0; i < strings.size(); ++i)
+        offsets[i + 1] = offsets[i] + strings[i].size();
+
+    std::vector<uint32_t> index(slots, string_table_missing);
+    for (uint32_t id = 0; id < strings.size(); ++id) {
+        uint64_t slot = string_hash(strings[id]) & (slots - 1);
+        while (index[slot] != string_table_missing)
+            slot = (slot + 1) & (slots - 1);
+        index[slot] = id;
+    }
+
+    string_table_header header = {
+        string_table_magic, (uint32_t)strings.size(), slots, 0,
+        offsets.back()};
+    size_t offsets_at = sizeof(header);
+    size_t index_at = offsets_at + offsets.size() * sizeof(uint64_t);
+    header.strings = index_at + index.size() * sizeof(uint32_t);
+
+    size_t size = std::max<size_t>(header.strings + header.strings_size, 1);
+    return build_file(path, size, [&](writable_file* out) {
+        bool success = out->write_bytes(0, &header, sizeof(header)) &&
+            out->write_bytes(offsets_at, offsets.data(),
+                offsets.size() * sizeof(uint64_t)) &&
+            out->write_bytes(index_at, index.data(),
+                index.size() * sizeof(uint32_t));
+
+        for (size_t i = 0; success && i < strings.size(); ++i)
+            success = out->write_bytes(header.strings + offsets[i],
+                strings[i].data(), strings[i].size());
+        return success;
+    });
+}
+#endif
+
+// A value that changes when a file is modified or truncated, 0 if it can't
+// be told
+static uint64_t file_version(file* f) {
+#if defined(_WIN32)
+    (void)f;
+    return 0;
+#else
+    posix_file* p = dynamic_cast<posix_file*>(f);
+    struct stat64 st;
+    if (!p || fstat64(p->fd, &st))
+        return 0;
+
+    uint64_t version = (uint64_t)st.st_ino;
+    version = version * 0x100000001b3ull ^ (uint64_t)st.st_size;
+    version = version * 0x100000001b3ull ^ (uint64_t)st.st_mtim.tv_sec;
+    version = version * 0x100000001b3ull ^ (uint64_t)st.st_mtim.tv_nsec;
+    return version | 1;
+#endif
+}
+
+// Copy ranges of a file, given as offset and length pairs, into anonymous
+// memory that file::read and file::read_bytes serve from without a guard.
+// With lock the copies are also mlocked so they can't be swapped out, and
+// pinning fails if they can't be. Replaces any regions already pinned.
+// Pinning and unpinning should only be done from one thread at a time.
+bool pin_hot_regions(
+        file* f, const std::vector<std::pair<size_t, size_t>>& ranges,
+        bool lock = false) {
+    std::unique_ptr<hot_region_set> set(new hot_region_set());
+    set->version = file_version(f);
+
+    for (const auto& [offset, length] : ranges) {
+        // Out of bounds check
+        assert(offset <= f->size && length <= f->size - offset);
+
+        hot_region_set::region r = {offset, length, nullptr, 0};
+        r.copy = hot_region_set::allocate_copy(length, &r.mapped);
+        if (!r.copy)
+            return false;
+        // The set frees the copy from here on
+        set->regions.push_back(r);
+        file_registry::get().copied_bytes += r.mapped;
+
+        // Copy straight from the mapping, not through any pinned copy
+        bool success = safe_mmap_try([&]() {
+            memcpy(r.copy, (const int8_t*)f->data + offset, length);
+        });
+        if (!success)
+            return false;
+    }
+
+#if !defined(_WIN32)
+    if (lock) {
+        for (size_t i = 0; i < set->regions.size(); ++i) {
+            const hot_region_set::region& r = set->regions[i];
+            if (mlock(r.copy, r.mapped)) {
+                // Undo the regions already locked
+                while (i--)
+                    munlock(set->regions[i].copy, set->regions[i].mapped);
+                return false;
+            }
+        }
+        set->locked = true;
+    }
+#else
+    (void)lock;
+#endif
+
+    const hot_region_set* old = f->hot.exchange(set.release());
+    if (old) {
+        old->unlock();
+        epoch_domain::get().retire([old]() { delete old; });
+    }
+    return true;
+}
+
+// Stop serving reads from pinned copies. They're unlocked straight away and
+// freed once no reader is using them.
+void unpin_hot_regions(file* f) {
+    const hot_region_set* old = f->hot.exchange(nullptr);
+    if (!old)
+        return;
+
+    old->unlock();
+    epoch_domain::get().retire([old]() { delete old; });
+}
+
+// Unpin a file's hot regions if the file has changed since they were
+// copied, returning whether they're still pinned. Call this when the file
+// may have changed, checking on every read would cost more than the guard.
+bool check_hot_regions(file* f) {
+    const hot_region_set* current = f->hot.load();
+    if (!current)
+        return false;
+
+    if (file_version(f) != current->version) {
+        unpin_hot_regions(f);
+        return false;
+    }
+    return true;
+}
+
+// How a mapping_cache responds to memory pressure. Pressure is the PSI
+// "some" avg10 percentage, the share of the last 10 seconds in which some
+// task was stalled waiting on memory.
+struct pressure_policy {
+    // Bytes of mappings the cache keeps open when there's no pressure
+    size_t budget = (size_t)1 << 30;
+
+    // The budget is never shrunk below this
+    size_t min_budget = (size_t)64 << 20;
+
+    // Mappings unused for this long are idle
+    std::chrono::milliseconds idle_after{10000};
+
+    // How often get() polls pressure, explicit check() calls always poll
+    std::chrono::milliseconds interval{1000};
+
+    // Above this idle mappings are marked MADV_COLD
+    double cold_threshold = 10.0;
+
+    // Above this idle mappings are paged out or unmapped, and the budget is
+    // multiplied by shrink_factor. It grows back once pressure drops below
+    // cold_threshold.
+    double pageout_threshold = 40.0;
+    double shrink_factor = 0.5;
+};
+
+struct pressure_counters {
+    uint64_t checks = 0;
+    uint64_t cold = 0;
+    uint64_t pageouts = 0;
+    uint64_t unmapped = 0;
+    uint64_t evicted = 0;
+    uint64_t shrinks = 0;
+};
+
+struct memory_pressure {
+    bool valid = false;
+    double some_avg10 = 0;
+    double full_avg10 = 0;
+
+    // Count of cgroup memory.events "high" and "max" events so far, if
+    // cgroup_events_valid
+    bool cgroup_events_valid = false;
+    uint64_t cgroup_events = 0;
+};
+
+// Read the system's memory pressure. Uses PSI where the kernel has it,
+// otherwise the event counts of the process's cgroup, found through
+// /proc/self/cgroup. Only cgroup v2 has memory.events.
+memory_pressure read_memory_pressure() {
+    memory_pressure result;
+
+#if defined(__linux__)
+    auto read_text = [](const char* path, char* buffer, size_t length) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        ssize_t n = read(fd, buffer, length - 1);
+        close(fd);
+        if (n <= 0)
+            return false;
+
+        buffer[n] = 0;
+        return true;
+    };
+
+    char buffer[1024];
+    if (read_text("/proc/pressure/memory", buffer, sizeof(buffer))) {
+        const char* some = strstr(buffer, "some avg10=");
+        const char* full = strstr(buffer, "full avg10=");
+        if (some) {
+            result.valid = true;
+            result.some_avg10 = strtod(some + 11, nullptr);
+        }
+        if (full)
+            result.full_avg10 = strtod(full + 11, nullptr);
+    }
+
+    // The process's cgroup v2 path is on the "0::" line of its cgroup list
+    char cgroups[4096];
+    std::string events;
+    if (read_text("/proc/self/cgroup", cgroups, sizeof(cgroups))) {
+        const char* line = strstr(cgroups, "0::/");
+        if (line && (line == cgroups || line[-1] == '\n')) {
+            const char* end = strchr(line, '\n');
+            events = "/sys/fs/cgroup" +
+                std::string(line + 3, end ? end : line + strlen(line));
+            if (events.back() != '/')
+                events += '/';
+            events += "memory.events";
+        }
+    }
+
+    if (!events.empty() &&
+            read_text(events.c_str(), buffer, sizeof(buffer))) {
+        result.cgroup_events_valid = true;
+        for (const char* key : {"\nhigh ", "\nmax "}) {
+            const char* line = strstr(buffer, key);
+            if (line) {
+                result.cgroup_events +=
+                    strtoull(line + strlen(key), nullptr, 10);
+            }
+        }
+    }
+#endif
+
+    return result;
+}
+
+// Keeps files mapped between uses, up to a budget of mapped bytes, and gives
+// memory back when the system is under pressure. Files are shared with
+// callers, so one is only unmapped once the cache and every caller have
+// dropped it.
+struct mapping_cache {
+    pressure_policy policy;
+
+    explicit mapping_cache(const pressure_policy& p = pressure_policy())
+        : policy(p), budget(p.budget) {}
+
+    // Open a file through the cache, mapping it if it isn't already
+    std::shared_ptr<file> get(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_check >= policy.interval)
+            check_locked(now);
+
+        auto it = index.find(path);
+        if (it != index.end()) {
+            // Move to the front of the LRU
+            entries.splice(entries.begin(), entries, it->second);
+            it->second->last_used = now;
+            return it->second->f;
+        }
+
+        std::shared_ptr<file> f(open_file(path.c_str()));
+        if (!f)
+            return nullptr;
+
+        entries.push_front({path, f, now});
+        index[path] = entries.begin();
+        mapped += f->size;
+
+        evict_locked();
+        return f;
+    }
+
+    // Poll memory pressure and respond to it now
+    void check() {
+        std::lock_guard<std::mutex> lock(mutex);
+        check_locked(std::chrono::steady_clock::now());
+    }
+
+    pressure_counters counters() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    // Bytes of mappings held by the cache
+    size_t mapped_bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return mapped;
+    }
+
+    // The budget after any shrinking due to pressure
+    size_t current_budget() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return budget;
+    }
+
+    // The last pressure that was read
+    memory_pressure last_pressure() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pressure;
+    }
+
+private:
+    struct entry {
+        std::string path;
+        std::shared_ptr<file> f;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    std::mutex mutex;
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    size_t mapped = 0;
+    size_t budget;
+    pressure_counters stats;
+    memory_pressure pressure;
+    std::chrono::steady_clock::time_point last_check;
+
+    void remove_locked(std::list<entry>::iterator it) {
+        mapped -= it->f->size;
+        index.erase(it->path);
+        entries.erase(it);
+    }
+
+    // Drop least recently used files that nobody else holds until under
+    // budget
+    void evict_locked() {
+        auto it = entries.end();
+        while (mapped > budget && it != entries.begin()) {
+            --it;
+            if (it->f.use_count() == 1) {
+                remove_locked(it++);
+                stats.evicted++;
+            }
+        }
+    }
+
+    void check_locked(std::chrono::steady_clock::time_point now) {
+        last_check = now;
+        stats.checks++;
+
+        memory_pressure previous = pressure;
+        pressure = read_memory_pressure();
+
+        // Without PSI any new cgroup high or max event counts as heavy
+        // pressure, the cgroup is already being throttled or reclaimed. The
+        // counts start at 0, so a rise from 0 counts too.
+        double level = pressure.some_avg10;
+        if (!pressure.valid && previous.cgroup_events_valid &&
+                pressure.cgroup_events > previous.cgroup_events)
+            level = policy.pageout_threshold;
+
+        if (level < policy.cold_threshold) {
+            // Let the budget recover
+            budget = std::min(policy.budget, std::max(budget, budget * 2));
+            return;
+        }
+
+        bool heavy = level >= policy.pageout_threshold;
+        if (heavy && budget > policy.min_budget) {
+            budget = std::max(
+                policy.min_budget, (size_t)(budget * policy.shrink_factor));
+            stats.shrinks++;
+        }
+
+        for (auto it = entries.begin(); it != entries.end();) {
+            auto current = it++;
+            if (now - current->last_used < policy.idle_after)
+                continue;
+
+            // Idle files nobody else holds can just be unmapped
+            if (heavy && current->f.use_count() == 1) {
+                remove_locked(current);
+                stats.unmapped++;
+                continue;
+            }
+
+#if defined(__linux__)
+            void* data = (void*)current->f->data;
+#if defined(MADV_PAGEOUT)
+            if (heavy) {
+                if (!madvise(data, current->f->size, MADV_PAGEOUT))
+                    stats.pageouts++;
+                continue;
+            }
+#endif
+#if defined(MADV_COLD)
+            if (!madvise(data, current->f->size, MADV_COLD))
+                stats.cold++;
+#endif
+            (void)data;
+#endif
+        }
+
+        evict_locked();
+    }
+};
+
+// Memory use of mappings, in bytes
+struct residency {
+    size_t mapped = 0;
+    size_t resident = 0;
+    size_t dirty = 0;
+    size_t swapped = 0;
+};
+
+typedef std::function<void(const file*, const residency&)> residency_fn;
+
+// Measure how much of every live file's mapping is resident, dirty and
+// swapped out, calling fn with each file's residency and returning the
+// total. On linux this is one pass over /proc/self/smaps, elsewhere only
+// resident bytes are known, found with file::resident_bytes. The registry
+// is locked while fn runs, so it mustn't destroy files.
+residency scan_residency(const residency_fn& fn = nullptr) {
+    file_registry& registry = file_registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    std::vector<std::pair<const file*, residency>> results;
+    results.reserve(registry.files.size());
+    for (const file* f : registry.files)
+        results.push_back({f, residency{f->mapped_size, 0, 0, 0}});
+
+#if defined(__linux__)
+    // Areas in smaps cover whole pages, so one holding the end of a mapping
+    // reaches past mapped_size to the next page boundary
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    // Sort by address to find which mapping each smaps entry falls in
+    std::sort(results.begin(), results.end(), [](const auto& a, const auto& b) {
+        return (uintptr_t)a.first->data < (uintptr_t)b.first->data;
+    });
+
+    FILE* smaps = fopen("/proc/self/smaps", "re");
+    if (smaps) {
+        residency* current = nullptr;
+        char line[512];
+        while (fgets(line, sizeof(line), smaps)) {
+            uintptr_t start, end;
+            size_t kb;
+
+            // Each area starts with a header line giving its address range,
+            // counted if it lies within one of our mappings
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+                current = nullptr;
+                auto it = std::upper_bound(
+                    results.begin(), results.end(), start,
+                    [](uintptr_t address, const auto& r) {
+                        return address < (uintptr_t)r.first->data;
+                    });
+                if (it != results.begin()) {
+                    --it;
+                    uintptr_t base = (uintptr_t)it->first->data;
+                    size_t length =
+                        (it->first->mapped_size + page - 1) & ~(page - 1);
+                    if (end <= base + length)
+                        current = &it->second;
+                }
+            } else if (!current) {
+                continue;
+            } else if (sscanf(line, "Rss: %zu kB", &kb) == 1) {
+                current->resident += kb * 1024;
+            } else if (sscanf(line, "Shared_Dirty: %zu kB", &kb) == 1 ||
+                       sscanf(line, "Private_Dirty: %zu kB", &kb) == 1) {
+                current->dirty += kb * 1024;
+            } else if (sscanf(line, "Swap: %zu kB", &kb) == 1) {
+                current->swapped += kb * 1024;
+            }
+        }
+        fclose(smaps);
+    }
+
+    // Count only the bytes of the last page that are mapped, as
+    // file::resident_bytes does
+    for (auto& [f, r] : results) {
+        r.resident = std::min(r.resident, r.mapped);
+        r.dirty = std::min(r.dirty, r.mapped);
+        r.swapped = std::min(r.swapped, r.mapped);
+    }
+#else
+    for (auto& [f, r] : results)
+        r.resident = f->resident_bytes();
+#endif
+
+    residency total;
+    for (const auto& [f, r] : results) {
+        total.mapped += r.mapped;
+        total.resident += r.resident;
+        total.dirty += r.dirty;
+        total.swapped += r.swapped;
+        if (fn)
+            fn(f, r);
+    }
+    return total;
+}
+
+// NUMA nodes that have memory, read from sysfs. Empty where it can't be
+// told.
+std::vector<int> numa_memory_nodes() {
+    std::vector<int> nodes;
+#if defined(__linux__)
+    for (const char* path : {"/sys/devices/system/node/has_memory",
+                             "/sys/devices/system/node/online"}) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        char buffer[1024];
+        ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (n <= 0)
+            continue;
+        buffer[n] = 0;
+
+        // A list of nodes and ranges, such as "0-1,4"
+        char* c = buffer;
+        while (*c >= '0' && *c <= '9') {
+            int first = (int)strtol(c, &c, 10);
+            int last = first;
+            if (*c == '-')
+                last = (int)strtol(c + 1, &c, 10);
+            for (int node = first; node <= last; ++node)
+                nodes.push_back(node);
+            if (*c == ',')
+                ++c;
+        }
+        break;
+    }
+#endif
+    return nodes;
+}
+
+// Copy a file into anonymous memory bound to each NUMA node with memory,
+// so file::read and file::read_bytes on any thread are served from memory
+// local to it. Meant for hot read-only files, changes to the file after
+// this aren't seen. read_batch and the scanning functions still use the
+// mapping. With a single node a copy only doubles memory use, so nothing is
+// done unless forced. Replaces any existing replicas.
+bool replicate_to_nodes(file* f, bool force = false) {
+#if defined(__linux__)
+    std::vector<int> nodes = numa_memory_nodes();
+    if (f->size == 0 || nodes.empty() || (nodes.size() == 1 && !force))
+        return false;
+
+    std::unique_ptr<numa_replica_set> set(new numa_replica_set());
+    set->length = f->size;
+    set->copies.assign(*std::max_element(nodes.begin(), nodes.end()) + 1,
+                       nullptr);
+
+    const size_t bits = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> mask(set->copies.size() / bits + 1);
+
+    for (int node : nodes) {
+        void* copy = mmap(
+            nullptr, f->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy == MAP_FAILED)
+            return false;
+        set->copies[node] = (uint8_t*)copy;
+        file_registry::get().copied_bytes += f->size;
+
+        // Bind before the copy touches any page, so each is allocated on the
+        // node. Without the binding a copy gains nothing.
+        std::fill(mask.begin(), mask.end(), 0);
+        mask[node / bits] |= 1ul << (node % bits);
+        if (syscall(
+                SYS_mbind, copy, f->size, MPOL_BIND, mask.data(),
+                mask.size() * bits + 1, 0))
+            return false;
+
+        bool success = safe_mmap_try([&]() {
+            memcpy(copy, f->data, f->size);
+        });
+        if (!success)
+            return false;
+        mprotect(copy, f->size, PROT_READ);
+    }
+
+    const numa_replica_set* old = f->replicas.exchange(set.release());
+    if (old)
+        epoch_domain::get().retire([old]() { delete old; });
+    return true;
+#else
+    (void)f;
+    (void)force;
+    return false;
+#endif
+}
+
+// Go back to reading through the mapping, the replicas are freed once no
+// reader is using them
+void drop_replicas(file* f) {
+    const numa_replica_set* old = f->replicas.exchange(nullptr);
+    if (old)
+        epoch_domain::get().retire([old]() { delete old; });
+}
+
+// Time fn, returning the number of nanoseconds per item for count items
+template<typename F>
+double time_per_item(size_t count, F fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+        (double)count;
+}
+
+#if !defined(_WIN32)
+// Evict a file's pages from the page cache so the next reads come from
+// disk. The kernel won't drop pages that are still mapped or dirty, so
+// they're unmapped from this process and written back first.
+static void drop_page_cache(file* f, const char * path) {
+    madvise((void*)f->data, f->size, MADV_DONTNEED);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+#endif
+
+// Compare batch read modes over random offsets. Small batches stay cache
+// resident, so the loads themselves dominate; the large batches show how
+// each mode copes once it is bound by memory rather than issue. The cold
+// runs drop the page cache first, where reading in address order lets
+// readahead turn the faults into sequential disk reads.
+static void bench_batch(file* f, const char * path, std::mt19937& rng) {
+#if defined(_WIN32)
+    (void)path;
+#endif
+    std::cout << "batch (prefetch distance " << prefetch_distance() << "):"
+        << std::endl;
+
+    auto random = std::uniform_int_distribution<size_t>(
+        0, f->size - sizeof(int64_t));
+
+    const struct {
+        const char * name;
+        unsigned flags;
+    } modes[] = {
+        {"scalar", batch_default},
+        {"sorted", batch_sorted},
+        {"gather", batch_gather},
+        {"prefetch", batch_prefetch},
+    };
+
+    for (size_t count : {64, 4096, 1 << 20}) {
+        std::vector<size_t> offsets(count);
+        for (size_t& offset : offsets)
+            offset = random(rng);
+
+        std::vector<int64_t> results(count);
+        std::unique_ptr<bool[]> ok(new bool[count]);
+
+        size_t rounds = std::max<size_t>(1, (1 << 24) / count);
+        for (const auto& mode : modes) {
+            double ns = time_per_item(count * rounds, [&]() {
+                for (size_t i = 0; i < rounds; ++i)
+                    f->read_batch(
+                        offsets.data(), count, results.data(), ok.get(),
+                        mode.flags);
+            });
+
+            std::cout << "  batch " << count << " " << mode.name << " "
+                << ns << " ns/item" << std::endl;
+        }
+
+#if !defined(_WIN32)
+        // A cold batch of 64 is over too quickly to time
+        if (count < 4096)
+            continue;
+
+        for (const auto& mode : {modes[0], modes[1]}) {
+            drop_page_cache(f, path);
+            double ns = time_per_item(count, [&]() {
+                f->read_batch(
+                    offsets.data(), count, results.data(), ok.get(),
+                    mode.flags);
+            });
+
+            std::cout << "  batch " << count << " " << mode.name << " cold "
+                << ns << " ns/item" << std::endl;
+        }
+#endif
+    }
+}
+
+#if !defined(_WIN32)
+// Compare interleaved lookups against one binary search at a time, over a
+// sorted copy of the file's values
+static void bench_lookup(file* f, std::mt19937& rng) {
+    std::vector<int64_t> sorted(f->size / sizeof(int64_t));
+    if (sorted.empty() || !safe_mmap_try([&]() {
+            memcpy(sorted.data(), f->data, sorted.size() * sizeof(int64_t));
+        }))
+        return;
+    std::sort(sorted.begin(), sorted.end());
+
+    char path[] = "/tmp/read_mmap_sorted_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+
+    size_t bytes = sorted.size() * sizeof(int64_t);
+    bool written = write(fd, sorted.data(), bytes) == (ssize_t)bytes;
+    close(fd);
+
+    file* sorted_file = written ? open_file(path) : nullptr;
+    unlink(path);
+    if (!sorted_file)
+        return;
+
+    std::cout << "lookup:" << std::endl;
+
+    // Half the keys are present, half are random and almost always missing
+    const size_t count = 1 << 20;
+    std::vector<int64_t> keys(count);
+    for (size_t i = 0; i < count; ++i)
+        keys[i] = i % 2 ? sorted[rng() % sorted.size()] : (int64_t)rng();
+
+    std::vector<size_t> positions(count);
+    std::vector<lookup_status> statuses(count);
+
+    for (size_t group : {1, 4, 16, 32}) {
+        double ns = time_per_item(count, [&]() {
+            lookup_sorted(
+                sorted_file, keys.data(), count, positions.data(),
+                statuses.data(), group);
+        });
+
+        std::cout << "  group " << group << " " << ns << " ns/lookup"
+            << std::endl;
+    }
+
+    delete sorted_file;
+}
+#endif
+
+// Reduction throughput over the whole file, with and without a histogram
+static void bench_reduce(file* f) {
+    std::cout << "reduce:" << std::endl;
+
+    histogram_options options = {INT64_MIN / 2, INT64_MAX / 2, 256};
+
+    for (const histogram_options* o : {(histogram_options*)nullptr, &options}) {
+        auto start = std::chrono::steady_clock::now();
+        reduction result = reduce_file(f, 0, f->size, o);
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << (o ? "  histogram " : "  sum/min/max ")
+            << (double)f->size / seconds / (1 << 30) << " GB/s, "
+            << result.faulted_chunks.size() << " faulted chunks"
+            << std::endl;
+    }
+}
+
+// Compare the multi-pattern matcher against std::search for each pattern
+static void bench_search(file* f, std::mt19937& rng) {
+    std::cout << "search:" << std::endl;
+
+    // Half the patterns are taken from the file so there are some hits
+    std::vector<std::string> patterns;
+    for (size_t i = 0; i < 16; ++i) {
+        std::string pattern(8, '\0');
+        if (i % 2 == 0 && f->size >= pattern.size()) {
+            size_t offset = rng() % (f->size - pattern.size() + 1);
+            if (!f->read_bytes(offset, pattern.size(), &pattern[0]))
+                return;
+        } else {
+            for (char& c : pattern)
+                c = (char)rng();
+        }
+        patterns.push_back(pattern);
+    }
+
+    multi_matcher matcher(patterns);
+    search_results results;
+
+    double matcher_ns = time_per_item(f->size, [&]() {
+        results = search_files(&f, 1, matcher);
+    });
+
+    size_t baseline_hits = 0;
+    double baseline_ns = time_per_item(f->size, [&]() {
+        safe_mmap_try([&]() {
+            const char* begin = (const char*)f->data;
+            const char* end = begin + f->size;
+            for (const std::string& pattern : patterns) {
+                const char* at = begin;
+                while ((at = std::search(
+                        at, end, pattern.begin(), pattern.end())) != end) {
+                    ++baseline_hits;
+                    ++at;
+                }
+            }
+        });
+    });
+
+    std::cout << "  matcher " << 1 / matcher_ns << " GB/s, "
+        << results.hits.size() << " hits" << std::endl;
+    std::cout << "  std::search " << 1 / baseline_ns << " GB/s, "
+        << baseline_hits << " hits" << std::endl;
+}
+
+#if !defined(_WIN32)
+// Compare writing records through a writable mapping against a write()
+// call per record
+static void bench_write() {
+    std::cout << "write:" << std::endl;
+
+    const size_t count = 1 << 20;
+    char path[] = "/tmp/read_mmap_write_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+
+    double write_ns = time_per_item(count, [&]() {
+        for (size_t i = 0; i < count; ++i) {
+            int64_t value = (int64_t)i;
+            if (write(fd, &value, sizeof(value)) != sizeof(value))
+                break;
+        }
+    });
+    close(fd);
+    unlink(path);
+
+    writable_file* f = open_writable_file(path, count * sizeof(int64_t));
+    if (!f)
+        return;
+
+    double mapped_ns = time_per_item(count, [&]() {
+        for (size_t i = 0; i < count; ++i)
+            f->write(i * sizeof(int64_t), (int64_t)i);
+    });
+    delete f;
+    unlink(path);
+
+    std::cout << "  write() " << write_ns << " ns/record" << std::endl;
+    std::cout << "  mapped " << mapped_ns << " ns/record" << std::endl;
+}
+#endif
+
+#if !defined(_WIN32)
+// Lookups per second for binary search over sorted files of increasing size
+// against the same values in Eytzinger order
+static void bench_eytzinger(std::mt19937& rng) {
+    std::cout << "eytzinger:" << std::endl;
+
+    for (size_t bytes : {1 << 20, 16 << 20, 256 << 20}) {
+        char path[] = "/tmp/read_mmap_sorted_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0)
+            return;
+        close(fd);
+
+        size_t n = bytes / sizeof(int64_t);
+        writable_file* out = open_writable_file(path, bytes);
+        if (!out) {
+            unlink(path);
+            return;
+        }
+        for (size_t i = 0; i < n; ++i)
+            ((int64_t*)out->data)[i] = (int64_t)(i * 2);
+        delete out;
+
+        std::string tree_path = std::string(path) + ".eytzinger";
+        file* sorted = open_file(path);
+        eytzinger_file* tree = nullptr;
+        if (sorted && convert_to_eytzinger(sorted, tree_path.c_str()))
+            tree = open_eytzinger_file(tree_path.c_str());
+
+        if (tree) {
+            const size_t count = 1 << 20;
+            std::vector<int64_t> keys(count);
+            for (int64_t& key : keys)
+                key = (int64_t)(rng() % (2 * n));
+
+            const int64_t* values = (const int64_t*)sorted->data;
+            size_t binary_found = 0, tree_found = 0;
+
+            double binary_ns = time_per_item(count, [&]() {
+                for (int64_t key : keys) {
+                    safe_mmap_try([&]() {
+                        const int64_t* at = std::lower_bound(
+                            values, values + n, key);
+                        binary_found += at != values + n && *at == key;
+                    });
+                }
+            });
+
+            double tree_ns = time_per_item(count, [&]() {
+                for (int64_t key : keys) {
+                    bool found;
+                    if (tree->contains(key, &found))
+                        tree_found += found;
+                }
+            });
+
+            std::cout << "  " << (bytes >> 20) << "MB binary "
+                << 1e3 / binary_ns << "M/s, eytzinger "
+                << 1e3 / tree_ns << "M/s"
+                << (binary_found == tree_found ? "" : " (mismatch)")
+                << std::endl;
+        }
+
+        delete tree;
+        delete sorted;
+        unlink(tree_path.c_str());
+        unlink(path);
+    }
+}
+#endif
+
+#if !defined(_WIN32)
+// Probe cost and false positive rate of a Bloom filter, probing with keys
+// that were never added
+static void bench_bloom(std::mt19937& rng) {
+    std::cout << "bloom:" << std::endl;
+
+    for (size_t count : {1 << 16, 1 << 22}) {
+        std::vector<uint8_t> keys(count * hash_key_size);
+        for (uint8_t& byte : keys)
+            byte = (uint8_t)rng();
+
+        char path[] = "/tmp/read_mmap_bloom_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0)
+            return;
+        close(fd);
+
+        bloom_filter* filter = nullptr;
+        if (build_bloom_filter(path, keys.data(), count))
+            filter = open_bloom_filter(path);
+        unlink(path);
+        if (!filter)
+            return;
+
+        for (uint8_t& byte : keys)
+            byte = (uint8_t)rng();
+
+        size_t positives = 0;
+        double ns = time_per_item(count, [&]() {
+            for (size_t i = 0; i < count; ++i) {
+                bool present;
+                if (filter->may_contain(&keys[i * hash_key_size], &present))
+                    positives += present;
+            }
+        });
+
+        std::cout << "  " << count << " keys " << ns << " ns/probe, "
+            << 100.0 * positives / count << "% false positives" << std::endl;
+        delete filter;
+    }
+}
+#endif
+
+#if !defined(_WIN32)
+// Random read throughput from a compressed container against the raw
+// mapped file, with the page cache dropped first and then warm
+static void bench_compressed(std::mt19937& rng) {
+    std::cout << "compressed:" << std::endl;
+
+    // Slowly varying values, roughly how offsets and timestamps compress
+    const size_t count = 8 << 20;
+    std::vector<int64_t> values(count);
+    for (size_t i = 0; i < count; ++i)
+        values[i] = (int64_t)(i * 1000 + rng() % 100);
+
+    char path[] = "/tmp/read_mmap_raw_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    bool written = write(fd, values.data(), count * sizeof(int64_t)) ==
+        (ssize_t)(count * sizeof(int64_t));
+    close(fd);
+
+    std::string compressed_path = std::string(path) + ".z";
+    file* raw = written ? open_file(path) : nullptr;
+    compressed_file* compressed = nullptr;
+    if (raw && build_compressed(
+            compressed_path.c_str(), values.data(), raw->size))
+        compressed = open_compressed_file(compressed_path.c_str());
+
+    if (compressed) {
+        struct stat64 st;
+        stat64(compressed_path.c_str(), &st);
+        std::cout << "  ratio " << (double)raw->size / st.st_size << std::endl;
+
+        // Random reads each inflate a whole block, sequential ones share it
+        const size_t reads = 1 << 16;
+        std::vector<size_t> random(reads), sequential(reads);
+        for (size_t i = 0; i < reads; ++i) {
+            random[i] = (rng() % count) * sizeof(int64_t);
+            sequential[i] = i * sizeof(int64_t);
+        }
+
+        for (bool cold : {true, false}) {
+            for (const std::vector<size_t>* offsets : {&random, &sequential}) {
+                if (cold) {
+                    drop_page_cache(raw, path);
+                    drop_page_cache(compressed->f, compressed_path.c_str());
+                    compressed->clear_cache();
+                }
+
+                int64_t value;
+                double raw_ns = time_per_item(reads, [&]() {
+                    for (size_t offset : *offsets)
+                        raw->read(offset, &value);
+                });
+                double compressed_ns = time_per_item(reads, [&]() {
+                    for (size_t offset : *offsets)
+                        compressed->read(offset, &value);
+                });
+
+                std::cout << (cold ? "  cold " : "  warm ")
+                    << (offsets == &random ? "random" : "sequential")
+                    << " raw " << 8e3 / raw_ns << " MB/s, compressed "
+                    << 8e3 / compressed_ns << " MB/s" << std::endl;
+            }
+        }
+    }
+
+    delete compressed;
+    delete raw;
+    unlink(compressed_path.c_str());
+    unlink(path);
+}
+#endif
+
+#if defined(__linux__)
+// Count dTLB read misses on this thread while fn runs, or -1 if the counter
+// isn't available
+template<typename F>
+static int64_t count_dtlb_misses(F fn) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        fn();
+        return -1;
+    }
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    fn();
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    int64_t count = -1;
+    if (::read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    close(fd);
+    return count;
+}
+
+// Random reads across the file mapped normally, mapped with huge pages and
+// copied into huge pages, with dTLB misses where the counter is available
+static void bench_huge_pages(const char * path, std::mt19937& rng) {
+    std::cout << "huge pages:" << std::endl;
+
+    const struct {
+        const char * name;
+        open_options options;
+    } modes[] = {
+        {"4K pages", {}},
+        {"huge aligned", {true, false}},
+        {"huge copy", {false, true}},
+    };
+
+    for (const auto& mode : modes) {
+        file* f = open_file(path, mode.options);
+        if (!f)
+            continue;
+
+        // Touch everything first so page faults aren't counted
+        reduce_file(f, 0, f->size);
+
+        const size_t count = 1 << 22;
+        std::vector<size_t> offsets(count);
+        for (size_t& offset : offsets)
+            offset = rng() % (f->size - sizeof(int64_t) + 1);
+
+        std::vector<int64_t> results(count);
+        std::unique_ptr<bool[]> ok(new bool[count]);
+
+        double ns = 0;
+        int64_t misses = count_dtlb_misses([&]() {
+            ns = time_per_item(count, [&]() {
+                f->read_batch(offsets.data(), count, results.data(), ok.get());
+            });
+        });
+
+        std::cout << "  " << mode.name << " " << ns << " ns/read, ";
+        if (misses >= 0)
+            std::cout << (double)misses / count << " dTLB misses/read";
+        else
+            std::cout << "dTLB counter unavailable";
+        std::cout << std::endl;
+
+        delete f;
+    }
+}
+// Random reads from each node's replica from this thread, so one is local
+// and the rest remote, and through file::read which picks the local one
+static void bench_numa(const char * path, std::mt19937& rng) {
+    std::cout << "numa:" << std::endl;
+
+    file* f = open_file(path);
+    if (!f)
+        return;
+
+    // Force a copy on single node systems so there's something to time
+    if (f->size < sizeof(int64_t) || !replicate_to_nodes(f, true)) {
+        std::cout << "  replication failed" << std::endl;
+        delete f;
+        return;
+    }
+
+    std::cout << "  copied " << file_registry::get().copied_bytes
+              << " bytes" << std::endl;
+
+    const size_t count = 1 << 22;
+    std::vector<size_t> offsets(count);
+    for (size_t& offset : offsets)
+        offset = rng() % (f->size - sizeof(int64_t) + 1);
+
+    // Nothing replaces the replicas while timing, so no guard is needed
+    const numa_replica_set* set = f->replicas.load();
+    int local = current_numa_node();
+    int64_t sum = 0;
+    size_t copies = 0;
+
+    for (size_t node = 0; node < set->copies.size(); ++node) {
+        const uint8_t* copy = set->copies[node];
+        if (!copy)
+            continue;
+        ++copies;
+
+        double ns = time_per_item(count, [&]() {
+            for (size_t offset : offsets) {
+                int64_t value;
+                memcpy(&value, copy + offset, sizeof(value));
+                sum += value;
+            }
+        });
+        std::cout << "  node " << node
+                  << ((int)node == local ? " (local) " : " (remote) ")
+                  << ns << " ns/read" << std::endl;
+    }
+
+    double ns = time_per_item(count, [&]() {
+        for (size_t offset : offsets) {
+            int64_t value;
+            if (f->read(offset, &value))
+                sum += value;
+        }
+    });
+    std::cout << "  file::read " << ns << " ns/read" << std::endl;
+
+    if (copies == 1)
+        std::cout << "  one node only, nothing remote to compare" << std::endl;
+
+    // Keep the reads from being optimized away
+    if (sum == 1)
+        std::cout << std::endl;
+
+    delete f;
+}
+#endif
+
+#if defined(__linux__)
+// Touch every page of a file whose size isn't a multiple of the page size,
+// then check scan_residency agrees with file::resident_bytes
+static void bench_residency() {
+    std::cout << "residency:" << std::endl;
+
+    char path[] = "/tmp/read_mmap_residency_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    close(fd);
+
+    writable_file* w = open_writable_file(path, 10000);
+    if (!w) {
+        unlink(path);
+        return;
+    }
+    for (size_t offset = 0; offset + sizeof(int64_t) <= w->size; offset += 8)
+        w->write(offset, (int64_t)offset);
+    delete w;
+
+    file* f = open_file(path);
+    unlink(path);
+    if (!f)
+        return;
+
+    int64_t value;
+    for (size_t offset = 0; offset + sizeof(int64_t) <= f->size; offset += 8)
+        f->read(offset, &value);
+
+    size_t scanned = 0;
+    residency total = scan_residency([&](const file* g, const residency& r) {
+        if (g == f)
+            scanned = r.resident;
+    });
+
+    size_t resident = f->resident_bytes();
+    std::cout << "  smaps " << scanned << " bytes, mincore " << resident
+              << " bytes, " << total.resident << " bytes resident in all files"
+              << std::endl;
+    assert(scanned == resident);
+
+    delete f;
+}
+#endif
+
+static void run_benchmarks(file* f, const char * path) {
+    std::mt19937 rng;
+    rng.seed(std::random_device()());
+
+    calibrate_prefetch_distance();
+
+    bench_batch(f, path, rng);
+    bench_reduce(f);
+    bench_search(f, rng);
+#if !defined(_WIN32)
+    bench_lookup(f, rng);
+    bench_write();
+    bench_eytzinger(rng);
+    bench_bloom(rng);
+    bench_compressed(rng);
+#endif
+#if defined(__linux__)
+    bench_huge_pages(path, rng);
+    bench_numa(path, rng);
+    bench_residency();
+#endif
+}
+
+int main(int argc, char const *argv[]) {
+    // Assume we're given 1 argument, optionally preceded by --bench
+    bool bench = argc == 3 && strcmp(argv[1], "--bench") == 0;
+    if (argc != 2 && !bench) {
+        return 1;
     }
 
     install_signal_handlers();
 
     // Open the requested file
-    file* f = open_file(argv[1]);
+    file* f = open_file(argv[argc - 1]);
+
+    if (bench) {
+        run_benchmarks(f, argv[argc - 1]);
+        delete f;
+        return 0;
+    }
 
     // Setup some random number generation
     std::mt19937 rng;